@@ -0,0 +1,132 @@
+// Compares the newline scanner kernels against the Hyperscan literal "\n" stream the loader used to use.
+// Usage: newline_bench [file] [iterations]
+//  With no file, a synthetic buffer of short and long lines is generated.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <hs/hs.h>
+
+#include "dynarray.h"
+#include "file.h"
+#include "newline_scanner.h"
+
+using namespace std::chrono;
+
+static constexpr size_t CHUNK_SIZE = 1ULL * 1024 * 1024;
+
+struct HsContext {
+	dynarray<size_t> results {};
+	NewlineScanner::State state {};
+};
+
+static int hs_event_handler(unsigned int, unsigned long long, unsigned long long to, unsigned int, void *context) {
+	auto &ctx = *static_cast<HsContext *>(context);
+	ctx.results.push_back(to);
+	ctx.state.longest_line = std::max<size_t>(ctx.state.longest_line, to - ctx.state.prev_start);
+	ctx.state.prev_start = to;
+	return 0;
+}
+
+static bool run_hyperscan(const uint8_t *data, size_t length, size_t &num_lines, size_t &longest_line) {
+	hs_database_t *db {};
+	hs_scratch_t *scratch {};
+	hs_stream_t *stream {};
+	hs_compile_error_t *compile_err {};
+
+	if (hs_compile_lit("\n", 0, 1, HS_MODE_STREAM, nullptr, &db, &compile_err) != HS_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to compile pattern: %s\n", compile_err->message);
+		hs_free_compile_error(compile_err);
+		return false;
+	}
+	if (hs_alloc_scratch(db, &scratch) != HS_SUCCESS || hs_open_stream(db, 0, &stream) != HS_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to allocate scratch space or stream\n");
+		hs_free_scratch(scratch);
+		hs_free_database(db);
+		return false;
+	}
+
+	HsContext ctx {};
+	for (size_t offset = 0; offset < length; offset += CHUNK_SIZE) {
+		size_t chunk_size = std::min(length - offset, CHUNK_SIZE);
+		hs_scan_stream(stream, (const char*)data + offset, chunk_size, 0, scratch, hs_event_handler, &ctx);
+	}
+	hs_close_stream(stream, scratch, nullptr, nullptr);
+	hs_free_scratch(scratch);
+	hs_free_database(db);
+
+	num_lines = ctx.results.size();
+	longest_line = ctx.state.longest_line;
+	return true;
+}
+
+static bool run_kernel(NewlineScanner::Kernel kernel, const uint8_t *data, size_t length, size_t &num_lines, size_t &longest_line) {
+	dynarray<size_t> results {};
+	NewlineScanner::State state {};
+	for (size_t offset = 0; offset < length; offset += CHUNK_SIZE) {
+		size_t chunk_size = std::min(length - offset, CHUNK_SIZE);
+		kernel(data + offset, chunk_size, offset, results, state);
+	}
+	num_lines = results.size();
+	longest_line = state.longest_line;
+	return true;
+}
+
+template<typename Fn>
+static void report(const char *name, size_t length, int iterations, Fn &&fn) {
+	size_t num_lines {}, longest_line {};
+	auto best = nanoseconds::max();
+	for (int i = 0; i < iterations; i++) {
+		auto start = steady_clock::now();
+		if (!fn(num_lines, longest_line)) {
+			return;
+		}
+		best = std::min(best, duration_cast<nanoseconds>(steady_clock::now() - start));
+	}
+	double mb_s = (double)length / (1024. * 1024.) / (best.count() / 1e9);
+	printf("%-10s %10.1f MB/s  %12zu lines  longest %zu\n", name, mb_s, num_lines, longest_line);
+}
+
+int main(int argc, char *argv[]) {
+	const int iterations = argc > 2 ? atoi(argv[2]) : 5;
+	std::vector<uint8_t> synthetic {};
+	const uint8_t *data;
+	size_t length;
+
+	File file {argc > 1 ? argv[1] : ""};
+	if (argc > 1) {
+		if (file.open() != 0 || file.mmap() != 0) {
+			fprintf(stderr, "Failed to map %s\n", argv[1]);
+			return 1;
+		}
+		data = file.mapped_data();
+		length = file.mapped_size();
+	} else {
+		std::mt19937 rng {1};
+		synthetic.resize(1ULL * 1024 * 1024 * 1024);
+		for (size_t i = 0; i < synthetic.size(); i++) {
+			synthetic[i] = 'a' + (i % 26);
+		}
+		// Mostly ~100 character lines, with the odd very long one
+		for (size_t i = 0; i < synthetic.size(); i += (rng() % 1000 == 0) ? 100000 : 40 + rng() % 120) {
+			synthetic[i] = '\n';
+		}
+		data = synthetic.data();
+		length = synthetic.size();
+	}
+
+	printf("%zu B, best of %d\n", length, iterations);
+	report("hyperscan", length, iterations, [&](auto &n, auto &l) { return run_hyperscan(data, length, n, l); });
+	for (const auto &k : NewlineScanner::kernels()) {
+		if (!k.supported) {
+			printf("%-10s not supported\n", k.name);
+			continue;
+		}
+		report(k.name, length, iterations, [&](auto &n, auto &l) { return run_kernel(k.kernel, data, length, n, l); });
+	}
+
+	file.close();
+	return 0;
+}
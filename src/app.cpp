@@ -67,16 +67,15 @@ int App::start(int argc, char *argv[]) {
     }
 
     if (argc > 1) {
-        for (int i = 1; i < argc; i++) {
-            add_file(argv[i]);
-        }
+        // NOTE: Several files are opened as one, e.g. app.log*
+        add_files({argv + 1, argv + argc});
     }
 
     return 0;
 }
 
-int App::add_file(const char *path) {
-    auto view = FileView::create(this, path);
+int App::add_files(const std::vector<const char *> &paths) {
+    auto view = FileView::create(this, paths);
     {
         Timeit file_open_timeit("View Open");
         if (view->open() != 0) {
@@ -127,9 +126,7 @@ bool App::on_scroll(glm::dvec2 offset, Window::KeyMods mods) {
 }
 
 bool App::on_drop(int path_count, const char* paths[]) {
-    for (int i = 0; i < path_count; i++) {
-        add_file(paths[i]);
-    }
+    add_files({paths, paths + path_count});
     return true;
 }
 
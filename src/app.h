@@ -21,7 +21,8 @@ class App : public Widget {
 	App(AppWindow &window);
 
 	[[nodiscard]] int start(int argc, char *argv[]);
-	[[nodiscard]] int add_file(const char *path);
+	// Opens a view of the given files, read back to back as one
+	[[nodiscard]] int add_files(const std::vector<const char *> &paths);
 	[[nodiscard]] int run();
 
 	void file_worker();
@@ -0,0 +1,258 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#ifdef WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "dataset.h"
+#include "file.h"
+#include "finder.h"
+#include "index_cache.h"
+#include "input_processor.h"
+#include "newline_scanner.h"
+#include "source.h"
+
+using namespace std::chrono;
+
+struct Faults {
+	int64_t major;
+	int64_t minor;
+};
+
+static Faults faults() {
+#ifdef WIN32
+	// NOTE: Windows doesn't tell hard and soft faults apart
+	PROCESS_MEMORY_COUNTERS counters {};
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return {-1, counters.PageFaultCount};
+#else
+	struct rusage usage {};
+	getrusage(RUSAGE_SELF, &usage);
+	return {usage.ru_majflt, usage.ru_minflt};
+#endif
+}
+
+static double ms_since(steady_clock::time_point start) {
+	return duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e6;
+}
+
+Benchmark::Benchmark(const char *path, std::string pattern, std::vector<FileSource::Backend> backends)
+	: path_(path), pattern_(std::move(pattern)), backends_(std::move(backends)) {
+}
+
+int Benchmark::evict() {
+	File file {path_};
+	if (file.open() != 0) {
+		return -1;
+	}
+	int ret = file.evict();
+	file.close();
+	return ret;
+}
+
+std::unique_ptr<Source> Benchmark::create_source(FileSource::Backend backend) const {
+	auto source = Source::create(path_);
+	// NOTE: Backends only apply to plain files
+	if (dynamic_cast<FileSource *>(source.get())) {
+		return std::make_unique<FileSource>(path_, backend);
+	}
+	return source;
+}
+
+int Benchmark::run_once(FileSource::Backend backend, bool cold, Result &result) {
+	result = {backend, cold};
+
+	if (cold && evict() != 0) {
+		fprintf(stderr, "Failed to evict %s from the page cache\n", path_);
+		return -1;
+	}
+	{
+		File file {path_};
+		if (file.open() != 0 || file.mmap() != 0) {
+			return -2;
+		}
+		// NOTE: Always 0 on Windows, where a fresh mapping has none of the file in its working set, see resident_size()
+		result.resident = (double)file.resident_size() / file.mapped_size();
+		file.close();
+	}
+
+	const auto start = steady_clock::now();
+	std::atomic<int64_t> first_line_ns {-1};
+
+	Dataset dataset {nullptr};
+	InputProcessor loader {create_source(backend), dataset, [&] {
+		int64_t none = -1;
+		first_line_ns.compare_exchange_strong(none, duration_cast<nanoseconds>(steady_clock::now() - start).count());
+	}};
+	Finder finder {dataset};
+
+	// Load
+	const auto load_faults = faults();
+	loader.start();
+	{
+		auto user = dataset.wait([this](size_t length) { return length >= size_; });
+	}
+	result.load_ms = ms_since(start);
+	result.first_line_ms = first_line_ns / 1e6;
+	result.num_lines = loader.user().line_starts().size() - 1;
+	const auto find_faults = faults();
+	result.load_major_faults = find_faults.major - load_faults.major;
+	result.load_minor_faults = find_faults.minor - load_faults.minor;
+
+	// Find
+	const auto find_start = steady_clock::now();
+	if (finder.submit(this, nullptr, pattern_, 0) != 0) {
+		return -3;
+	}
+	while (true) {
+		{
+			auto user = finder.user();
+			const auto &job = user.jobs().at(this);
+			if (job->status() == Finder::Job::Status::kERROR || job->status() == Finder::Job::Status::kBAD_PATTERN) {
+				return -4;
+			}
+			if (job->scanned() >= size_) {
+				result.num_matches = job->results().size();
+				break;
+			}
+		}
+		// NOTE: Polling adds up to a millisecond, which is noise at the file sizes worth benchmarking
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	result.find_ms = ms_since(find_start);
+	const auto end_faults = faults();
+	result.find_major_faults = end_faults.major - find_faults.major;
+	result.find_minor_faults = end_faults.minor - find_faults.minor;
+
+	finder.stop();
+	loader.stop();
+	return 0;
+}
+
+void Benchmark::report(const Result &result) const {
+	const double mb = size_ / (1024. * 1024.);
+	printf("%-6s %-4s  resident %5.1f%%  first line %9.2f ms  load %9.2f ms %8.1f MB/s (%lld/%lld faults)  find %9.2f ms %8.1f MB/s (%lld/%lld faults)\n",
+		FileSource::name(result.backend),
+		result.cold ? "cold" : "warm",
+		result.resident * 100,
+		result.first_line_ms,
+		result.load_ms, mb / (result.load_ms / 1e3), (long long)result.load_major_faults, (long long)result.load_minor_faults,
+		result.find_ms, mb / (result.find_ms / 1e3), (long long)result.find_major_faults, (long long)result.find_minor_faults);
+	fflush(stdout);
+}
+
+int Benchmark::run(int runs) {
+	{
+		auto source = create_source(backends_.front());
+		if (source->open() != 0) {
+			fprintf(stderr, "Failed to open %s\n", path_);
+			return -1;
+		}
+		// NOTE: Compressed files only find out their size by decoding them
+		do {
+			if (source->update(source->available()) != 0) {
+				fprintf(stderr, "Failed to read %s\n", path_);
+				return -1;
+			}
+		} while (source->has_more());
+		size_ = source->length();
+		source->close();
+	}
+	if (size_ == 0) {
+		fprintf(stderr, "%s is empty\n", path_);
+		return -1;
+	}
+
+	printf("%s: %zu B, pattern \"%s\", %s newline scanner, %d runs (faults are major/minor)\n", path_, size_, pattern_.c_str(),
+		NewlineScanner::best().name, runs);
+	std::vector<Result> results {};
+	for (auto backend : backends_) {
+		for (bool cold : {true, false}) {
+			for (int i = 0; i < runs; i++) {
+				Result result;
+				if (int ret = run_once(backend, cold, result); ret != 0) {
+					fprintf(stderr, "Benchmark run failed: %d\n", ret);
+					return ret;
+				}
+				if (cold && result.resident > 0.01) {
+					fprintf(stderr, "WARNING: %.1f%% of the file is still cached. Is it open in another process?\n", result.resident * 100);
+				}
+				report(result);
+				results.push_back(result);
+			}
+		}
+	}
+
+	// Medians are less sensitive to the odd disturbed run than means
+	printf("median:\n");
+	for (auto backend : backends_) for (bool cold : {true, false}) {
+		std::vector<Result> mode {};
+		std::copy_if(results.begin(), results.end(), std::back_inserter(mode), [backend, cold](const auto &r) {
+			return r.backend == backend && r.cold == cold;
+		});
+		auto median = [&mode]<typename T>(T Result::*field) {
+			std::vector<T> values {};
+			for (const auto &r : mode) {
+				values.push_back(r.*field);
+			}
+			std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+			return values[values.size() / 2];
+		};
+		report({
+			backend,
+			cold,
+			median(&Result::resident),
+			median(&Result::first_line_ms),
+			median(&Result::load_ms),
+			median(&Result::find_ms),
+			mode.front().num_lines,
+			mode.front().num_matches,
+			median(&Result::load_major_faults),
+			median(&Result::load_minor_faults),
+			median(&Result::find_major_faults),
+			median(&Result::find_minor_faults),
+		});
+	}
+	printf("%zu lines, %zu matches\n", results.back().num_lines, results.back().num_matches);
+	return 0;
+}
+
+int Benchmark::main(int argc, char *argv[]) {
+	// argv[1] is --benchmark
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s --benchmark <file> [pattern] [runs] [mmap,pread,direct]\n", argv[0]);
+		return 1;
+	}
+	std::vector<FileSource::Backend> backends {};
+	const std::string names = argc > 5 ? argv[5] : "mmap,pread";
+	for (size_t start = 0; start <= names.size();) {
+		const size_t end = std::min(names.find(',', start), names.size());
+		const auto name = names.substr(start, end - start);
+		bool found = false;
+		for (auto backend : {FileSource::Backend::kMMAP, FileSource::Backend::kPREAD, FileSource::Backend::kDIRECT}) {
+			if (name == FileSource::name(backend)) {
+				backends.push_back(backend);
+				found = true;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "Unknown backend \"%s\"\n", name.c_str());
+			return 1;
+		}
+		start = end + 1;
+	}
+	IndexCache::disable();
+	TrigramIndex::disable();
+	Benchmark benchmark {argv[2], argc > 3 ? argv[3] : "error", std::move(backends)};
+	return benchmark.run(argc > 4 ? std::max(1, atoi(argv[4])) : 3);
+}
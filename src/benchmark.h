@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_source.h"
+
+// Headless benchmark of the loader and Finder, run with
+//  `log_viewer --benchmark <file> [pattern] [runs] [backends]`, where backends is a comma separated list of
+//  mmap, pread and direct (mmap,pread by default).
+//
+// Each cold run first drops the file from the page cache (see File::evict()), so that I/O regressions show up without
+//  having to flush the whole cache by exhausting memory. Warm runs follow, with the file fully cached. Every backend
+//  gets the same runs, to compare them on the storage the file is on.
+// NOTE: The index cache is disabled, so every run indexes the whole file.
+class Benchmark {
+	struct Result {
+		FileSource::Backend backend;
+		bool cold;
+		double resident;
+		double first_line_ms;
+		double load_ms;
+		double find_ms;
+		size_t num_lines;
+		size_t num_matches;
+		int64_t load_major_faults;
+		int64_t load_minor_faults;
+		int64_t find_major_faults;
+		int64_t find_minor_faults;
+	};
+
+	const char *path_;
+	std::string pattern_;
+	std::vector<FileSource::Backend> backends_;
+	size_t size_ {};
+
+	int evict();
+	std::unique_ptr<Source> create_source(FileSource::Backend backend) const;
+	int run_once(FileSource::Backend backend, bool cold, Result &result);
+	void report(const Result &result) const;
+
+public:
+	Benchmark(const char *path, std::string pattern, std::vector<FileSource::Backend> backends);
+
+	int run(int runs);
+
+	static int main(int argc, char *argv[]);
+};
@@ -0,0 +1,525 @@
+#include "compressed_source.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <zlib.h>
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(USE_LZ4)
+#include <lz4frame.h>
+#endif
+
+// Decodes the compressed input front to back, starting from a checkpoint
+class CompressedSource::Decoder {
+protected:
+	const File &input_;
+	size_t in_ {};
+	size_t out_ {};
+	size_t last_checkpoint_ {};
+	bool end_ {};
+
+	virtual int reset(const Checkpoint &checkpoint) = 0;
+
+	bool want_checkpoint() const {
+		return out_ - last_checkpoint_ >= CHECKPOINT_SPAN;
+	}
+
+	void add_checkpoint(std::vector<Checkpoint> &checkpoints, Checkpoint &&checkpoint) {
+		last_checkpoint_ = checkpoint.out;
+		checkpoints.push_back(std::move(checkpoint));
+	}
+
+public:
+	explicit Decoder(const File &input) : input_(input) {}
+	virtual ~Decoder() = default;
+
+	// Offset in the decompressed output that the next decode() continues from
+	size_t position() const { return out_; }
+	// The end of the compressed stream has been reached
+	bool at_end() const { return end_; }
+
+	int seek(const Checkpoint &checkpoint) {
+		in_ = checkpoint.in;
+		out_ = checkpoint.out;
+		last_checkpoint_ = checkpoint.out;
+		end_ = false;
+		return reset(checkpoint);
+	}
+
+	// Decodes up to size bytes into out, and returns the number of bytes produced, or a negative error. Stops early at
+	//  the end of the stream, or of the input available so far. If checkpoints is set, a checkpoint is appended to it
+	//  whenever decoding can be resumed from the current position and the previous one is far enough behind.
+	virtual int64_t decode(uint8_t *out, size_t size, std::vector<Checkpoint> *checkpoints) = 0;
+};
+
+// Handles multi-member files (e.g. from pigz or bgzip) too. Checkpoints between deflate blocks work as in zlib's zran
+//  example: the decoder is primed with the bits of the last partially consumed byte, and the preceding 32 KB of output
+//  as its dictionary.
+class GzipDecoder : public CompressedSource::Decoder {
+	static constexpr int GZIP_WINDOW_BITS = MAX_WBITS + 16;
+
+	z_stream strm_ {};
+	bool ok_ {};
+	// Resumed in the middle of a member, so inflate() doesn't know about the gzip framing
+	bool raw_ {};
+
+	// A member ended. Returns false if there isn't another one after it.
+	bool next_member(std::vector<CompressedSource::Checkpoint> *checkpoints) {
+		if (raw_) {
+			// Skip the CRC and size trailer, which raw inflate doesn't consume
+			in_ += 8;
+		}
+		const uint8_t *data = input_.mapped_data();
+		if (in_ + 2 > input_.mapped_size() || data[in_] != 0x1f || data[in_ + 1] != 0x8b) {
+			// NOTE: Anything else after the last member (e.g. zero padding) is ignored
+			return false;
+		}
+		raw_ = false;
+		inflateReset2(&strm_, GZIP_WINDOW_BITS);
+		if (checkpoints && want_checkpoint()) {
+			add_checkpoint(*checkpoints, {in_, out_, true});
+		}
+		return true;
+	}
+
+protected:
+	int reset(const CompressedSource::Checkpoint &checkpoint) override {
+		if (!ok_) {
+			return -1;
+		}
+		raw_ = !checkpoint.stream_start;
+		if (inflateReset2(&strm_, raw_ ? -MAX_WBITS : GZIP_WINDOW_BITS) != Z_OK) {
+			return -2;
+		}
+		if (!raw_) {
+			return 0;
+		}
+		if (checkpoint.bits) {
+			const uint8_t partial = input_.mapped_data()[checkpoint.in - 1];
+			if (inflatePrime(&strm_, checkpoint.bits, partial >> (8 - checkpoint.bits)) != Z_OK) {
+				return -3;
+			}
+		}
+		if (!checkpoint.window.empty() && inflateSetDictionary(&strm_, checkpoint.window.data(), checkpoint.window.size()) != Z_OK) {
+			return -4;
+		}
+		return 0;
+	}
+
+public:
+	explicit GzipDecoder(const File &input) : Decoder(input) {
+		ok_ = inflateInit2(&strm_, GZIP_WINDOW_BITS) == Z_OK;
+	}
+
+	~GzipDecoder() override {
+		if (ok_) {
+			inflateEnd(&strm_);
+		}
+	}
+
+	int64_t decode(uint8_t *out, size_t size, std::vector<CompressedSource::Checkpoint> *checkpoints) override {
+		if (!ok_) {
+			return -1;
+		}
+		size_t produced = 0;
+		while (produced < size && !end_) {
+			const uint8_t *data = input_.mapped_data() + in_;
+			const size_t available = input_.mapped_size() - in_;
+			if (available == 0) {
+				break;
+			}
+			strm_.next_in = (Bytef *)data;
+			strm_.avail_in = (uInt)std::min<size_t>(available, UINT_MAX);
+			strm_.next_out = out + produced;
+			strm_.avail_out = (uInt)std::min<size_t>(size - produced, UINT_MAX);
+
+			// NOTE: Z_BLOCK stops at every deflate block boundary, which is where checkpoints can be taken
+			const int ret = inflate(&strm_, checkpoints ? Z_BLOCK : Z_NO_FLUSH);
+			const size_t consumed = strm_.next_in - data;
+			const size_t decoded = strm_.next_out - (out + produced);
+			in_ += consumed;
+			out_ += decoded;
+			produced += decoded;
+
+			if (ret == Z_STREAM_END) {
+				end_ = !next_member(checkpoints);
+				continue;
+			}
+			if (ret == Z_BUF_ERROR || (consumed == 0 && decoded == 0)) {
+				// Needs more input than has been written so far
+				break;
+			}
+			if (ret != Z_OK) {
+				return -2;
+			}
+
+			if (checkpoints && (strm_.data_type & 128) && !(strm_.data_type & 64) && want_checkpoint()) {
+				CompressedSource::Checkpoint checkpoint {in_, out_, false, strm_.data_type & 7};
+				uInt window_size = 32768;
+				checkpoint.window.resize(window_size);
+				if (inflateGetDictionary(&strm_, checkpoint.window.data(), &window_size) == Z_OK) {
+					checkpoint.window.resize(window_size);
+					add_checkpoint(*checkpoints, std::move(checkpoint));
+				}
+			}
+		}
+		return produced;
+	}
+};
+
+#if defined(USE_ZSTD)
+class ZstdDecoder : public CompressedSource::Decoder {
+	ZSTD_DCtx *ctx_ {ZSTD_createDCtx()};
+
+protected:
+	int reset(const CompressedSource::Checkpoint &checkpoint) override {
+		assert(checkpoint.stream_start);
+		return ctx_ && !ZSTD_isError(ZSTD_DCtx_reset(ctx_, ZSTD_reset_session_only)) ? 0 : -1;
+	}
+
+public:
+	explicit ZstdDecoder(const File &input) : Decoder(input) {}
+
+	~ZstdDecoder() override {
+		ZSTD_freeDCtx(ctx_);
+	}
+
+	int64_t decode(uint8_t *out, size_t size, std::vector<CompressedSource::Checkpoint> *checkpoints) override {
+		size_t produced = 0;
+		while (produced < size && !end_) {
+			ZSTD_inBuffer in {input_.mapped_data() + in_, input_.mapped_size() - in_, 0};
+			ZSTD_outBuffer dst {out + produced, size - produced, 0};
+			const size_t ret = ZSTD_decompressStream(ctx_, &dst, &in);
+			if (ZSTD_isError(ret)) {
+				return -2;
+			}
+			in_ += in.pos;
+			out_ += dst.pos;
+			produced += dst.pos;
+
+			if (ret == 0) {
+				// A frame ended, and the next one can be decoded on its own
+				end_ = in_ == input_.mapped_size();
+				if (!end_ && checkpoints && want_checkpoint()) {
+					add_checkpoint(*checkpoints, {in_, out_, true});
+				}
+			} else if (in.pos == 0 && dst.pos == 0) {
+				break;
+			}
+		}
+		return produced;
+	}
+};
+#endif
+
+#if defined(USE_LZ4)
+class Lz4Decoder : public CompressedSource::Decoder {
+	LZ4F_dctx *ctx_ {};
+
+protected:
+	int reset(const CompressedSource::Checkpoint &checkpoint) override {
+		assert(checkpoint.stream_start);
+		if (!ctx_) {
+			return -1;
+		}
+		LZ4F_resetDecompressionContext(ctx_);
+		return 0;
+	}
+
+public:
+	explicit Lz4Decoder(const File &input) : Decoder(input) {
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx_, LZ4F_VERSION))) {
+			ctx_ = nullptr;
+		}
+	}
+
+	~Lz4Decoder() override {
+		LZ4F_freeDecompressionContext(ctx_);
+	}
+
+	int64_t decode(uint8_t *out, size_t size, std::vector<CompressedSource::Checkpoint> *checkpoints) override {
+		size_t produced = 0;
+		while (produced < size && !end_) {
+			size_t consumed = input_.mapped_size() - in_;
+			size_t decoded = size - produced;
+			const size_t ret = LZ4F_decompress(ctx_, out + produced, &decoded, input_.mapped_data() + in_, &consumed, nullptr);
+			if (LZ4F_isError(ret)) {
+				return -2;
+			}
+			in_ += consumed;
+			out_ += decoded;
+			produced += decoded;
+
+			if (ret == 0) {
+				// A frame ended, and the next one can be decoded on its own
+				end_ = in_ == input_.mapped_size();
+				if (!end_ && checkpoints && want_checkpoint()) {
+					add_checkpoint(*checkpoints, {in_, out_, true});
+				}
+			} else if (consumed == 0 && decoded == 0) {
+				break;
+			}
+		}
+		return produced;
+	}
+};
+#endif
+
+CompressedSource::CompressedSource(const char *path, Format format) : input_(path), format_(format) {
+}
+
+CompressedSource::~CompressedSource() {
+	close();
+}
+
+bool CompressedSource::detect(const char *path, Format &format) {
+	uint8_t magic[4] {};
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return false;
+	}
+	const size_t n = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		format = Format::kGZIP;
+		return true;
+	}
+	if (n == 4 && std::memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+#if defined(USE_ZSTD)
+		format = Format::kZSTD;
+		return true;
+#else
+		std::cerr << path << " looks zstd compressed, but this build doesn't support zstd\n";
+#endif
+	}
+	if (n == 4 && std::memcmp(magic, "\x04\x22\x4d\x18", 4) == 0) {
+#if defined(USE_LZ4)
+		format = Format::kLZ4;
+		return true;
+#else
+		std::cerr << path << " looks lz4 compressed, but this build doesn't support lz4\n";
+#endif
+	}
+	return false;
+}
+
+std::unique_ptr<CompressedSource::Decoder> CompressedSource::create_decoder() const {
+	switch (format_) {
+#if defined(USE_ZSTD)
+		case Format::kZSTD: return std::make_unique<ZstdDecoder>(input_);
+#endif
+#if defined(USE_LZ4)
+		case Format::kLZ4: return std::make_unique<Lz4Decoder>(input_);
+#endif
+		default: return std::make_unique<GzipDecoder>(input_);
+	}
+}
+
+int CompressedSource::open() {
+	if (input_.open() != 0 || input_.mmap() != 0) {
+		return -1;
+	}
+
+	std::lock_guard lock(mtx_);
+	if (indexer_) {
+		return 0;
+	}
+	checkpoints_.push_back({0, 0, true});
+	cache_.reserve(CACHE_BLOCKS);
+	indexer_ = create_decoder();
+	indexer_block_ = std::make_unique_for_overwrite<uint8_t[]>(BLOCK_SIZE);
+	return indexer_->seek(checkpoints_.front());
+}
+
+void CompressedSource::close() {
+	std::lock_guard lock(mtx_);
+	cursors_.clear();
+	cache_.clear();
+	checkpoints_.clear();
+	indexer_.reset();
+	indexer_block_.reset();
+	input_.close();
+}
+
+size_t CompressedSource::available() const {
+	return end_ ? length_.load() : length_ + BATCH_SIZE;
+}
+
+int CompressedSource::update(size_t length) {
+	ZoneScopedN("CompressedSource::update");
+	if (!indexer_) {
+		return -1;
+	}
+
+	const size_t input_size = input_.size();
+	if (input_size != input_.mapped_size() && input_.can_map_in_place(input_size)) {
+		// NOTE: Cursors may be decoding the input on other threads, so it mustn't move. Compressed files hardly ever
+		//  grow anyway, let alone past the reservation.
+		std::lock_guard lock(mtx_);
+		input_.mmap(input_size);
+	}
+
+	starved_ = false;
+	while (length_ < length && !end_) {
+		const size_t index = length_ / BLOCK_SIZE;
+		const size_t offset = length_ % BLOCK_SIZE;
+		std::vector<Checkpoint> checkpoints {};
+		const int64_t n = indexer_->decode(indexer_block_.get() + offset, BLOCK_SIZE - offset, &checkpoints);
+		if (n < 0) {
+			std::cerr << "Failed to decompress " << path() << " after " << length_ << " B: " << n << "\n";
+			end_ = true;
+			return -2;
+		}
+		end_ = indexer_->at_end();
+		if (n == 0) {
+			starved_ = !end_;
+			break;
+		}
+
+		std::lock_guard lock(mtx_);
+		for (auto &checkpoint : checkpoints) {
+			checkpoints_.push_back(std::move(checkpoint));
+		}
+		const size_t size = offset + n;
+		if (size == BLOCK_SIZE) {
+			insert(index, std::move(indexer_block_), size);
+			indexer_block_ = std::make_unique_for_overwrite<uint8_t[]>(BLOCK_SIZE);
+		} else {
+			// The indexer carries on filling this block next time
+			auto copy = std::make_unique_for_overwrite<uint8_t[]>(size);
+			std::memcpy(copy.get(), indexer_block_.get(), size);
+			insert(index, std::move(copy), size);
+		}
+		length_ += n;
+	}
+	return 0;
+}
+
+CompressedSource::Block &CompressedSource::insert(size_t index, std::unique_ptr<uint8_t[]> &&data, size_t size) const {
+	auto it = std::find_if(cache_.begin(), cache_.end(), [index](const auto &block) { return block.index == index; });
+	if (it == cache_.end()) {
+		if (cache_.size() < CACHE_BLOCKS) {
+			it = cache_.emplace(cache_.end());
+		} else {
+			it = std::min_element(cache_.begin(), cache_.end(), [](const auto &a, const auto &b) { return a.last_use < b.last_use; });
+		}
+	}
+	*it = {index, size, ++clock_, std::move(data)};
+	return *it;
+}
+
+CompressedSource::Cursor CompressedSource::take_cursor(size_t out) const {
+	// The last checkpoint at or before out
+	auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), out, [](size_t out, const Checkpoint &checkpoint) {
+		return out < checkpoint.out;
+	});
+	assert(it != checkpoints_.begin());
+	const Checkpoint &checkpoint = *std::prev(it);
+
+	// Carrying on from where a cursor stopped beats seeking, as long as it's past the checkpoint
+	auto best = cursors_.end();
+	for (auto cursor = cursors_.begin(); cursor != cursors_.end(); ++cursor) {
+		const size_t position = cursor->decoder->position();
+		if (position >= checkpoint.out && position <= out && (best == cursors_.end() || position > best->decoder->position())) {
+			best = cursor;
+		}
+	}
+
+	Cursor cursor {};
+	if (best != cursors_.end()) {
+		cursor = std::move(*best);
+		cursors_.erase(best);
+		return cursor;
+	}
+
+	if (cursors_.size() < MAX_CURSORS) {
+		cursor.decoder = create_decoder();
+	} else {
+		auto lru = std::min_element(cursors_.begin(), cursors_.end(), [](const auto &a, const auto &b) { return a.last_use < b.last_use; });
+		cursor = std::move(*lru);
+		cursors_.erase(lru);
+	}
+	if (cursor.decoder->seek(checkpoint) != 0) {
+		cursor.decoder.reset();
+	}
+	return cursor;
+}
+
+const CompressedSource::Block *CompressedSource::load(std::unique_lock<LockableBase(std::mutex)> &lock, size_t index, size_t min_size) const {
+	for (auto &block : cache_) {
+		if (block.index == index && block.size >= min_size) {
+			block.last_use = ++clock_;
+			return &block;
+		}
+	}
+
+	ZoneScopedN("CompressedSource::load");
+	const size_t start = index * BLOCK_SIZE;
+	Cursor cursor = take_cursor(start);
+	if (!cursor.decoder) {
+		return nullptr;
+	}
+
+	// NOTE: Decode without holding the lock, so that readers of cached blocks (e.g. the FileView) don't have to wait
+	lock.unlock();
+	auto data = std::make_unique_for_overwrite<uint8_t[]>(BLOCK_SIZE);
+	int64_t n = 0;
+	// Skip ahead from the checkpoint to the start of the block
+	while (cursor.decoder->position() < start) {
+		n = cursor.decoder->decode(data.get(), std::min(start - cursor.decoder->position(), BLOCK_SIZE), nullptr);
+		if (n <= 0) {
+			break;
+		}
+	}
+	size_t size = 0;
+	while (n >= 0 && size < BLOCK_SIZE && cursor.decoder->position() == start + size) {
+		n = cursor.decoder->decode(data.get() + size, BLOCK_SIZE - size, nullptr);
+		if (n <= 0) {
+			break;
+		}
+		size += n;
+	}
+	lock.lock();
+
+	if (n < 0) {
+		std::cerr << "Failed to decompress " << path() << " block " << index << ": " << n << "\n";
+		// Start over from a checkpoint next time
+		return nullptr;
+	}
+	cursor.last_use = ++clock_;
+	cursors_.push_back(std::move(cursor));
+	if (cursors_.size() > MAX_CURSORS) {
+		// Other threads created extra cursors while this one was taken
+		cursors_.erase(std::min_element(cursors_.begin(), cursors_.end(), [](const auto &a, const auto &b) { return a.last_use < b.last_use; }));
+	}
+	if (size < min_size) {
+		return nullptr;
+	}
+	return &insert(index, std::move(data), size);
+}
+
+const uint8_t *CompressedSource::read(size_t offset, size_t length, uint8_t *buffer) const {
+	std::unique_lock lock(mtx_);
+	for (size_t done = 0; done < length;) {
+		const size_t position = offset + done;
+		const size_t index = position / BLOCK_SIZE;
+		const size_t block_offset = position % BLOCK_SIZE;
+		const size_t n = std::min(length - done, BLOCK_SIZE - block_offset);
+
+		const Block *block = load(lock, index, block_offset + n);
+		if (!block) {
+			// NOTE: Only happens if the file is corrupt, or was replaced while open
+			std::memset(buffer + done, 0, length - done);
+			break;
+		}
+		std::memcpy(buffer + done, block->data.get() + block_offset, n);
+		done += n;
+	}
+	return buffer;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "file.h"
+#include "source.h"
+#include "Tracy.hpp"
+
+// A gzip, zstd or lz4 compressed file, decompressed on demand.
+//
+// The loader's first pass decodes the file front to back, and records checkpoints along the way that decoding can be
+//  resumed from. Random reads then only need to decode from the nearest checkpoint, and the decoded blocks are kept in
+//  a small LRU cache. gzip checkpoints can be placed anywhere between deflate blocks, at the cost of a 32 KB window
+//  each. zstd and lz4 can only be resumed at frame boundaries, so files compressed as a single frame have to be decoded
+//  from the start to reach any block that dropped out of the cache. Multi-frame files (e.g. from pzstd, or zstd's
+//  seekable format) avoid that.
+class CompressedSource : public Source {
+public:
+	enum class Format {
+		kGZIP,
+		kZSTD,
+		kLZ4,
+	};
+
+	// A point decoding can be resumed from
+	struct Checkpoint {
+		// Offset in the compressed input
+		size_t in;
+		// Offset in the decompressed output
+		size_t out;
+		// Whether this is the start of a gzip member, or a zstd or lz4 frame. The fields below are only used otherwise.
+		bool stream_start;
+		// Number of bits of the byte at in - 1 that haven't been decoded yet
+		int bits;
+		// The last 32 KB of output before this point, which later data may refer back to
+		std::vector<uint8_t> window;
+	};
+
+	class Decoder;
+
+private:
+	// Unit of caching, in decompressed bytes
+	static constexpr size_t BLOCK_SIZE = 4ULL * 1024 * 1024;
+	// Minimum distance between checkpoints. This bounds how much has to be decoded to reach any block, and the memory
+	//  used by gzip windows (32 KB per checkpoint, so under 1%).
+	static constexpr size_t CHECKPOINT_SPAN = 4ULL * 1024 * 1024;
+	// Decoded per update(), so that the loader can index and publish the file piece by piece
+	static constexpr size_t BATCH_SIZE = 32ULL * 1024 * 1024;
+	static constexpr size_t CACHE_BLOCKS = 32;
+	// Decoders kept positioned after the last block they produced, so that concurrent sequential reads (e.g. several
+	//  Finder jobs) can each carry on without seeking
+	static constexpr size_t MAX_CURSORS = 4;
+
+	struct Block {
+		size_t index;
+		size_t size;
+		uint64_t last_use;
+		std::unique_ptr<uint8_t[]> data;
+	};
+
+	struct Cursor {
+		std::unique_ptr<Decoder> decoder;
+		uint64_t last_use;
+	};
+
+	File input_;
+	const Format format_;
+
+	// NOTE: Guards everything below, except for the indexer, which is only used by the loader thread
+	mutable TracyLockable(std::mutex, mtx_);
+	std::vector<Checkpoint> checkpoints_ {};
+	mutable std::vector<Block> cache_ {};
+	mutable std::vector<Cursor> cursors_ {};
+	mutable uint64_t clock_ {};
+
+	std::atomic<size_t> length_ {};
+	std::unique_ptr<Decoder> indexer_ {};
+	std::unique_ptr<uint8_t[]> indexer_block_ {};
+	// The indexer reached the end of the compressed stream
+	bool end_ {};
+	// The indexer ran out of input before the end of the stream, e.g. because the file is still being written
+	bool starved_ {};
+
+	std::unique_ptr<Decoder> create_decoder() const;
+	// Caches the given block, replacing any previous version of it
+	Block &insert(size_t index, std::unique_ptr<uint8_t[]> &&data, size_t size) const;
+	// Returns the block with the given index, decoding it if needed. Cached blocks shorter than min_size don't count.
+	// NOTE: The lock is released while decoding
+	const Block *load(std::unique_lock<LockableBase(std::mutex)> &lock, size_t index, size_t min_size) const;
+	// Removes the cursor that can reach out the quickest from the pool, or seeks one to the nearest checkpoint
+	Cursor take_cursor(size_t out) const;
+
+	CompressedSource() = delete;
+	CompressedSource(const CompressedSource &) = delete;
+	CompressedSource &operator=(const CompressedSource &) = delete;
+	CompressedSource(CompressedSource &&) = delete;
+	CompressedSource &operator=(CompressedSource &&) = delete;
+
+public:
+	CompressedSource(const char *path, Format format);
+	~CompressedSource() override;
+
+	// Returns true if the file at path starts with the magic number of a supported format
+	static bool detect(const char *path, Format &format);
+
+	int open() override;
+	void close() override;
+	const char *path() const override { return input_.path(); }
+	int64_t mtime() const override { return input_.mtime(); }
+
+	size_t available() const override;
+	bool has_more() const override { return !end_ && !starved_; }
+	int update(size_t length) override;
+	size_t length() const override { return length_; }
+
+	const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const override;
+
+	void advise(File::Access access) override { input_.advise(access); }
+};
@@ -0,0 +1,96 @@
+#include "concat_source.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+ConcatSource::ConcatSource(const std::vector<const char *> &paths) {
+	for (const char *path : paths) {
+		parts_.push_back({Source::create(path), 0});
+	}
+}
+
+int ConcatSource::open() {
+	std::erase_if(parts_, [](const Part &part) {
+		if (part.source->is_stream()) {
+			std::cerr << "Can't concatenate " << part.source->path() << ", streams can only be opened on their own\n";
+			return true;
+		}
+		if (part.source->open() != 0) {
+			std::cerr << "Failed to open " << part.source->path() << ", skipping it\n";
+			return true;
+		}
+		return false;
+	});
+	if (parts_.empty()) {
+		return -1;
+	}
+	std::stable_sort(parts_.begin(), parts_.end(), [](const Part &a, const Part &b) {
+		return a.source->mtime() < b.source->mtime();
+	});
+	for (const auto &part : parts_) {
+		std::cout << "  " << part.source->path() << "\n";
+	}
+	return 0;
+}
+
+void ConcatSource::close() {
+	for (auto &part : parts_) {
+		part.source->close();
+	}
+}
+
+bool ConcatSource::part_done() const {
+	const auto &source = *current().source;
+	return current_ + 1 < parts_.size() && !source.has_more() && source.length() >= source.available();
+}
+
+size_t ConcatSource::available() const {
+	if (part_done()) {
+		return length() + parts_[current_ + 1].source->available();
+	}
+	return current().start + current().source->available();
+}
+
+bool ConcatSource::can_update_in_place(size_t length) const {
+	return !part_done() && current().source->can_update_in_place(length - current().start);
+}
+
+void ConcatSource::set_retire(std::function<void(std::function<void()> &&)> &&retire) {
+	for (auto &part : parts_) {
+		part.source->set_retire(std::function(retire));
+	}
+}
+
+int ConcatSource::update(size_t length) {
+	if (part_done()) {
+		parts_[current_ + 1].start = this->length();
+		current_.store(current_ + 1, std::memory_order_release);
+	}
+	const Part &part = current();
+	return part.source->update(std::max(length, part.start) - part.start);
+}
+
+const uint8_t *ConcatSource::read(size_t offset, size_t length, uint8_t *buffer) const {
+	// The part containing offset. Parts past current_ may not have a start yet.
+	const auto end = parts_.begin() + current_.load(std::memory_order_acquire) + 1;
+	auto it = std::upper_bound(parts_.begin() + 1, end, offset,
+		[](size_t offset, const Part &part) { return offset < part.start; }) - 1;
+	if (it + 1 == end || offset + length <= it->start + it->source->length()) {
+		return it->source->read(offset - it->start, length, buffer);
+	}
+
+	// Spans parts
+	for (size_t done = 0; done < length; it++) {
+		const size_t pos = offset + done - it->start;
+		const size_t size = std::min(length - done, it->source->length() - pos);
+		if (size > 0) {
+			const uint8_t *data = it->source->read(pos, size, buffer + done);
+			if (data != buffer + done) {
+				std::memcpy(buffer + done, data, size);
+			}
+		}
+		done += size;
+	}
+	return buffer;
+}
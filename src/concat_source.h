@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "source.h"
+
+// Several files read back to back as one, e.g. a log and its rotated predecessors (app.log.5 ... app.log.1, app.log).
+//
+// The parts are ordered oldest first, by modification time, so that shell globs (which sort app.log.10 before
+//  app.log.2) come out right. Each part is a source of its own, so rotated files that were compressed on the way work
+//  too. Only the newest part is followed as it grows; earlier ones are read up to their size at the time the loader
+//  moves past them.
+// NOTE: A part that doesn't end with a newline runs into the first line of the next one
+class ConcatSource : public Source {
+	struct Part {
+		std::unique_ptr<Source> source;
+		// Offset of the part's first byte in the concatenation
+		size_t start;
+	};
+
+	// NOTE: Fixed once opened. Parts up to current_ have been (or are being) loaded, and their starts are known. Moving
+	//  on to the next part sets its start before current_, so readers that see the new current_ see the start too.
+	std::vector<Part> parts_ {};
+	std::atomic<size_t> current_ {};
+
+	const Part &current() const { return parts_[current_.load(std::memory_order_acquire)]; }
+	// The current part is fully loaded, and there is a next one
+	bool part_done() const;
+
+	ConcatSource() = delete;
+	ConcatSource(const ConcatSource &) = delete;
+	ConcatSource &operator=(const ConcatSource &) = delete;
+	ConcatSource(ConcatSource &&) = delete;
+	ConcatSource &operator=(ConcatSource &&) = delete;
+
+public:
+	explicit ConcatSource(const std::vector<const char *> &paths);
+	~ConcatSource() override = default;
+
+	int open() override;
+	void close() override;
+	// NOTE: The newest part, which is the one that's watched for changes
+	const char *path() const override { return parts_.back().source->path(); }
+	int64_t mtime() const override { return parts_.back().source->mtime(); }
+
+	// NOTE: The set of files may differ between runs
+	bool is_cacheable() const override { return false; }
+
+	size_t available() const override;
+	bool rotated() const override { return current_ + 1 == parts_.size() && current().source->rotated(); }
+	bool has_more() const override { return current_ + 1 < parts_.size() || current().source->has_more(); }
+	bool can_update_in_place(size_t length) const override;
+	void set_retire(std::function<void(std::function<void()> &&)> &&retire) override;
+	int update(size_t length) override;
+	size_t length() const override { return current().start + current().source->length(); }
+
+	const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const override;
+
+	void advise(File::Access access) override { parts_[current_].source->advise(access); }
+};
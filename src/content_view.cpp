@@ -43,13 +43,19 @@ void ContentView::scroll_h_cb(double percent) {
 }
 
 void ContentView::scroll_v_cb(double percent) {
-	parent().scroll_to({parent().scroll_.x, percent * parent().max_scroll().y}, true);
+	parent().scroll_to_fraction(percent);
 }
 
 void ContentView::update_scrollbar() {
 	// TODO the sizes are not quite right; they don't account for the overscroll region
 	scroll_h_.set(parent().scroll_.x, size().x, parent().longest_line_ * TextShader::font().size.x);
-	scroll_v_.set(parent().scroll_.y, size().y, parent().num_filtered_lines() * TextShader::font().size.y);
+	if (parent().preview_) {
+		// NOTE: A preview is only a window into the file, so place it where it would be in the whole file
+		const size_t line_height = TextShader::font().size.y;
+		scroll_v_.set(parent().scroll_.y + parent().first_line_number_ * line_height, size().y, parent().estimated_num_lines_ * line_height);
+	} else {
+		scroll_v_.set(parent().scroll_.y, size().y, parent().num_filtered_lines() * TextShader::font().size.y);
+	}
 }
 
 ivec2 ContentView::view_px_loc_to_abs_char_loc(ivec2 view_px_loc) {
@@ -168,7 +174,7 @@ bool ContentView::on_cursor_pos(ivec2 mouse) {
 		return false;
 	}
 
-	if (parent().line_starts_.empty()) {
+	if (parent().num_lines() == 0) {
 		return false;
 	}
 
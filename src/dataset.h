@@ -1,57 +1,61 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <condition_variable>
-#include <shared_mutex>
+#include <cstdint>
+#include <mutex>
+#include <thread>
 #include <functional>
+#include <vector>
 
+#include "source.h"
+#include "trigram_index.h"
 #include "util.h"
+#include "worker.h"
 #include "Tracy.hpp"
 
+// The data behind a FileView. The loader publishes it, and any number of readers (the view itself, Finder jobs, the
+//  previewer) read it concurrently.
+//
+// Readers see immutable snapshots. The loader publishes a new snapshot whenever the data grows or moves, without
+//  waiting for anyone, and each reader keeps the snapshot it started with for as long as it holds it. Memory an older
+//  snapshot may still point into (e.g. a mapping the source has moved away from) is handed to retire() rather than
+//  freed, and only freed once every reader that might have seen it is done (epoch based reclamation).
+//
+// The loader also indexes the trigrams of the data in the background, which Finder uses to skip the parts of a large
+//  dataset that can't match. Offsets never change meaning, as the data only ever grows, so the index stays valid.
 class Dataset {
-	class Updater {
-		friend class Dataset;
-
-		Dataset &dataset_;
-		Timeit t_ {"Dataset::~Updater"};
-
-		Updater(Dataset &dataset) : dataset_(dataset) {
-			Timeit t {"Dataset::Updater"};
-			dataset_.invalidate();
-		}
-
-		Updater() = delete;
-		Updater(const Updater &) = delete;
-		Updater &operator=(const Updater &) = delete;
-		Updater(Updater &&) = delete;
-		Updater &operator=(Updater &&) = delete;
-
-	public:
-		~Updater() {
-			dataset_.update();
-		}
-		void set(const uint8_t *data, size_t length) const {
-			dataset_.data_ = data;
-			dataset_.length_ = length;
-		}
+public:
+	struct Snapshot {
+		const Source *source;
+		// NOTE: Stays valid while the snapshot is held, even if the source has moved on since
+		const uint8_t *data;
+		size_t length;
+		// How much of the source could be read at the time, which may be more than has been indexed
+		size_t readable_length;
+		// Changes whenever the data moves or is replaced, but not when it's only extended
+		uint64_t generation;
 	};
 
-public:
 	class User {
 		friend class Dataset;
 
 		const Dataset &dataset_;
-		std::shared_lock<SharedLockableBase(std::shared_mutex)> lock_;
+		const size_t slot_;
+		// NOTE: The dataset may be extended while in use, but each user sees the snapshot at the time it was acquired
+		const Snapshot &snapshot_;
 
 		// Timeit ctor_ {"Dataset::User"};
 		// Timeit dtor_ {"Dataset::~User"};
 
-		User(const Dataset &dataset) : User(dataset, std::shared_lock(dataset.mtx_)) {}
-		User(const Dataset &dataset, std::shared_lock<SharedLockableBase(std::shared_mutex)> &&lock_) : dataset_(dataset), lock_(std::move(lock_)) {
+		User(const Dataset &dataset) : User(dataset, dataset.enter()) {}
+		User(const Dataset &dataset, size_t slot) : User(dataset, slot, *dataset.snapshot_.load()) {}
+		User(const Dataset &dataset, size_t slot, const Snapshot &snapshot) : dataset_(dataset), slot_(slot), snapshot_(snapshot) {
 			// ctor_.stop();
 		}
 
-
 		User() = delete;
 		User(const User &) = delete;
 		User &operator=(const User &) = delete;
@@ -59,37 +63,135 @@ public:
 		User &operator=(User &&) = delete;
 
 	public:
-		~User() = default;
-		const uint8_t *data() const { return dataset_.data_; }
-		size_t length() const { return dataset_.length_; }
+		~User() {
+			dataset_.leave(slot_);
+		}
+		// NOTE: nullptr if the data isn't contiguous in memory (e.g. a compressed file). Use read() then.
+		const uint8_t *data() const { return snapshot_.data; }
+		size_t length() const { return snapshot_.length; }
+		uint64_t generation() const { return snapshot_.generation; }
+		// Returns a pointer to [offset, offset + length), which is either into data() or into buffer
+		const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const {
+			assert(offset + length <= snapshot_.length);
+			return snapshot_.source->read(offset, length, buffer);
+		}
+		// Everything that can be read, including data past length() that isn't indexed yet
+		size_t readable_length() const { return snapshot_.readable_length; }
+		// Same as read(), but also covers data that isn't indexed yet. Only for previews while loading.
+		const uint8_t *peek(size_t offset, size_t length, uint8_t *buffer) const {
+			assert(offset + length <= snapshot_.readable_length);
+			return snapshot_.source->read(offset, length, buffer);
+		}
 	};
 
 private:
-	std::atomic_flag update_pending_ {};
+	// Number of users that can be active at once. Any more wait for a slot to free up. There's one for every worker of
+	//  the shared pool, so that the main thread and the loader never wait behind them.
+	static constexpr size_t MAX_USERS = WorkerPool::MAX_WORKERS + 8;
+
+	struct Retired {
+		// Value of epoch_ when the snapshot that replaced it was published
+		uint64_t epoch;
+		std::function<void()> free;
+	};
 
 	std::function<void()> on_data_ {};
-	std::function<void()> on_unmap_ {};
-	mutable TracySharedLockable(std::shared_mutex, mtx_);
-	std::condition_variable_any update_cv_ {};
-	const uint8_t *data_ {};
-	size_t length_ {};
-
-	void invalidate() {
-		// NOTE: This tells active users of the dataset that an update is pending, so they should release the lock
-		update_pending_.test_and_set();
-		if (on_unmap_) {
-			on_unmap_();
+	std::atomic<const Snapshot *> snapshot_;
+	// NOTE: Only touched by the loader, which is the only one that publishes snapshots
+	uint64_t generation_ {};
+	// Mirrors the current snapshot's length, for wait()
+	std::atomic<size_t> length_ {};
+	// Number of times the source was truncated or replaced, see rotate()
+	std::atomic<uint64_t> rotations_ {};
+
+	// Advances with every published snapshot. Each active user records the epoch it started in, 0 marks a free slot.
+	std::atomic<uint64_t> epoch_ {1};
+	mutable std::array<std::atomic<uint64_t>, MAX_USERS> user_epochs_ {};
+	mutable TracyLockable(std::mutex, retired_mtx_);
+	mutable std::vector<Retired> retired_ {};
+	mutable std::atomic<bool> has_retired_ {};
+	// NOTE: Retired since the last snapshot was published, which may still point into them. Only touched by the loader.
+	std::vector<std::function<void()>> pending_ {};
+
+	// NOTE: Waiters are woken through a separate mutex, so snapshots can be published without taking it
+	mutable std::mutex wait_mtx_;
+	mutable std::condition_variable update_cv_ {};
+	TracyLockable(std::mutex, listeners_mtx_);
+	std::vector<std::pair<const void *, std::function<void()>>> listeners_ {};
+	// NOTE: Only the loader adds to it
+	TrigramIndex trigrams_ {};
+
+	size_t enter() const {
+		// NOTE: Threads start looking at different slots, so they rarely contend for the same one
+		static std::atomic<size_t> next_hint {};
+		thread_local size_t hint = next_hint++ % MAX_USERS;
+		for (size_t i = hint;; i = (i + 1) % MAX_USERS) {
+			uint64_t free = 0;
+			// NOTE: The epoch is recorded before the snapshot is loaded, so anything replaced from here on waits for us
+			if (user_epochs_[i].load(std::memory_order_relaxed) == 0 && user_epochs_[i].compare_exchange_strong(free, epoch_.load())) {
+				hint = i;
+				return i;
+			}
+			if ((i + 1) % MAX_USERS == hint) {
+				std::this_thread::yield();
+			}
 		}
-		mtx_.lock();
 	}
 
-	void update() {
-		update_pending_.clear();
-		mtx_.unlock();
-		update_cv_.notify_all();
+	void leave(size_t slot) const {
+		user_epochs_[slot].store(0);
+		if (has_retired_.load(std::memory_order_relaxed)) {
+			reclaim();
+		}
+	}
+
+	// Frees whatever no active user can still reach. Doesn't wait if someone else is at it already.
+	void reclaim() const {
+		std::unique_lock lock(retired_mtx_, std::try_to_lock);
+		if (!lock.owns_lock()) {
+			return;
+		}
+		uint64_t oldest = UINT64_MAX;
+		for (const auto &epoch : user_epochs_) {
+			const uint64_t e = epoch.load();
+			if (e != 0) {
+				oldest = std::min(oldest, e);
+			}
+		}
+		// NOTE: Users that started after something was retired can only have seen what replaced it
+		auto it = retired_.begin();
+		for (; it != retired_.end() && it->epoch < oldest; it++) {
+			it->free();
+		}
+		retired_.erase(retired_.begin(), it);
+		has_retired_ = !retired_.empty();
+	}
+
+	void publish(const Snapshot &snapshot) {
+		const Snapshot *old = snapshot_.exchange(new Snapshot(snapshot));
+		length_ = snapshot.length;
+		pending_.push_back([old] { delete old; });
+
+		// NOTE: Users that start after this only see the new snapshot, so they can't reach anything retired before it
+		const uint64_t epoch = epoch_.fetch_add(1);
+		{
+			std::lock_guard lock(retired_mtx_);
+			for (auto &free : pending_) {
+				retired_.push_back({epoch, std::move(free)});
+			}
+			has_retired_ = true;
+		}
+		pending_.clear();
+		reclaim();
+
+		notify();
 		if (on_data_) {
 			on_data_();
 		}
+		std::lock_guard lock(listeners_mtx_);
+		for (const auto &[key, listener] : listeners_) {
+			listener();
+		}
 	}
 
 	Dataset() = delete;
@@ -99,27 +201,82 @@ private:
 	Dataset &operator=(Dataset &&) = delete;
 
 public:
-	Dataset(std::function<void()> &&on_data, std::function<void()> &&on_unmap) :
-		on_data_(std::move(on_data)), on_unmap_(std::move(on_unmap)) {
+	explicit Dataset(std::function<void()> &&on_data) :
+		on_data_(std::move(on_data)), snapshot_(new Snapshot {nullptr, nullptr, 0, 0, 0}) {
+	}
+	~Dataset() {
+		delete snapshot_.load();
+		for (auto &retired : retired_) {
+			retired.free();
+		}
+		for (auto &free : pending_) {
+			free();
+		}
 	}
-	~Dataset() = default;
 
-	void notify() { update_cv_.notify_all(); }
-	bool is_update_pending() const { return update_pending_.test();	}
-	Updater updater() {	return Updater(*this);}
+	void notify() {
+		// NOTE: Taking the lock ensures waiters are either before their predicate check, or already waiting
+		{ std::lock_guard lock(wait_mtx_); }
+		update_cv_.notify_all();
+	}
 	User user() const {	return User(*this);	}
+	// Length of the current snapshot, without holding on to it
+	size_t length() const { return length_; }
+	uint64_t rotations() const { return rotations_; }
+	const TrigramIndex &trigrams() const { return trigrams_; }
+	TrigramIndex &trigrams() { return trigrams_; }
+
+	// Called by the loader after each published snapshot, until removed. Once remove_listener() returns, the listener
+	//  isn't running and won't be called again.
+	void add_listener(const void *key, std::function<void()> &&listener) {
+		std::lock_guard lock(listeners_mtx_);
+		listeners_.emplace_back(key, std::move(listener));
+	}
+	void remove_listener(const void *key) {
+		std::lock_guard lock(listeners_mtx_);
+		std::erase_if(listeners_, [key](const auto &listener) { return listener.first == key; });
+	}
+
+	// Publishes new data, e.g. after the source moved it. readable is how much of the source can already be read, which
+	//  may be more than has been indexed. Users of older snapshots carry on with those.
+	void set(const Source *source, size_t length, size_t readable = 0) {
+		publish({source, source ? source->data() : nullptr, length, std::max(length, readable), ++generation_});
+	}
+
+	// Called by the loader when the source was truncated or replaced. The offsets before stay, but a truncated file's
+	//  old data reads as zeros from then on, so anything worked out from it before is stale.
+	void rotate() {
+		rotations_++;
+	}
 
-	User wait() {
-		std::shared_lock lock(mtx_);
-		update_cv_.wait(lock);
-		return {*this, std::move(lock)};
+	// Makes more data available at the same address
+	void extend(size_t length) {
+		// NOTE: Only the loader replaces the snapshot, so it can read it without entering
+		const Snapshot &current = *snapshot_.load();
+		assert(length >= current.length);
+		publish({current.source, current.data, length, std::max(length, current.readable_length), current.generation});
+	}
+
+	// Frees memory once no user can be reading it anymore, i.e. after the next snapshot is published and every user
+	//  of earlier ones is done. Sources use this from update() for memory that snapshots may still point into.
+	void retire(std::function<void()> &&free) {
+		pending_.push_back(std::move(free));
 	}
 
 	template<typename Predicate>
-	User wait(Predicate pred) {
-		std::shared_lock lock(mtx_);
-		while (!pred(length_))
-			update_cv_.wait(lock);
-		return {*this, std::move(lock)};
+	User wait(Predicate pred) const {
+		while (true) {
+			{
+				std::unique_lock lock(wait_mtx_);
+				update_cv_.wait(lock, [&] { return pred(length_.load()); });
+			}
+			const size_t slot = enter();
+			const Snapshot &snapshot = *snapshot_.load();
+			// NOTE: The dataset may have been replaced in the meantime
+			if (pred(snapshot.length)) {
+				return {*this, slot, snapshot};
+			}
+			leave(slot);
+		}
 	}
 };
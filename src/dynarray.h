@@ -8,12 +8,14 @@
 
 template<typename T>
 class dynarray {
+public:
 	struct DummyLock {
 		constexpr DummyLock() {}
 		constexpr void lock() {}
 		constexpr void unlock() {}
 	};
 
+private:
 	T* data_ {};
 	size_t size_ {};
 	size_t capacity_ {};
@@ -1,19 +1,112 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #ifdef WIN32
 #include <windows.h>
 #include <memoryapi.h>
+#include <psapi.h>
 #else
+#include <signal.h>
 #include <sys/mman.h>
+#include <atomic>
+#include <mutex>
 #endif
 
 #include "file.h"
 
+#ifndef WIN32
+// Optional mapping tweaks. They only pay off on some systems, so they're opt-in through the environment:
+//  LOG_VIEWER_MAP_POPULATE=1  Read the whole file in when mapping it, rather than faulting it in page by page
+//  LOG_VIEWER_HUGEPAGE=1      Back the mapping with huge pages where the kernel supports it for files
+//                             (CONFIG_READ_ONLY_THP_FOR_FS), which cuts page faults and TLB misses on large scans
+struct MapOptions {
+	bool populate;
+	bool hugepage;
+};
+
+static bool env_flag(const char *name) {
+	const char *value = getenv(name);
+	return value && *value && *value != '0';
+}
+
+static const MapOptions &map_options() {
+	static const MapOptions options {env_flag("LOG_VIEWER_MAP_POPULATE"), env_flag("LOG_VIEWER_HUGEPAGE")};
+	return options;
+}
+
+// Reading a mapping past the end of a file that was truncated raises SIGBUS, which would kill the process in the window
+//  before the loader notices and seals the file. Faults in the address ranges of mappings are handled by mapping a
+//  page of zeros over the faulting page instead, so that the read just carries on with zeros. Other SIGBUS go to
+//  whichever handler was installed before.
+//
+// NOTE: The handler can't take locks, so ranges are tracked in a fixed table of atomics. A slot is claimed by setting
+//  its start, and only matches once its end is set. Mappings beyond MAX_GUARDED_RANGES aren't guarded.
+struct GuardedRange {
+	std::atomic<uintptr_t> start;
+	std::atomic<uintptr_t> end;
+};
+
+static constexpr size_t MAX_GUARDED_RANGES = 256;
+static GuardedRange guarded_ranges[MAX_GUARDED_RANGES] {};
+static struct sigaction previous_sigbus {};
+static size_t guard_page_size {};
+
+static void on_sigbus(int sig, siginfo_t *info, void *context) {
+	const uintptr_t addr = (uintptr_t)info->si_addr;
+	for (auto &range : guarded_ranges) {
+		const uintptr_t start = range.start.load();
+		if (start != 0 && addr >= start && addr < range.end.load()) {
+			void *page = (void*)(addr & ~(guard_page_size - 1));
+			if (::mmap(page, guard_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+				return;
+			}
+			break;
+		}
+	}
+	// Not a truncated mapping. Returning retries the access, which faults again into the previous handler.
+	sigaction(SIGBUS, &previous_sigbus, nullptr);
+}
+
+// Starts or updates guarding [data, data + size)
+static void guard(const uint8_t *data, size_t size) {
+	static std::once_flag installed;
+	std::call_once(installed, [] {
+		guard_page_size = sysconf(_SC_PAGESIZE);
+		struct sigaction action {};
+		action.sa_sigaction = on_sigbus;
+		action.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGBUS, &action, &previous_sigbus);
+	});
+	const uintptr_t start = (uintptr_t)data;
+	for (auto &range : guarded_ranges) {
+		uintptr_t expected = 0;
+		if (range.start.load() == start || range.start.compare_exchange_strong(expected, start)) {
+			range.end = start + size;
+			return;
+		}
+	}
+}
+
+static void unguard(const uint8_t *data) {
+	for (auto &range : guarded_ranges) {
+		if (range.start.load() == (uintptr_t)data) {
+			range.end = 0;
+			range.start = 0;
+			return;
+		}
+	}
+}
+#endif
+
 File::File(const char *path) : path_(path) {
 }
 
-int File::open() {
+int File::open(bool direct) {
 #ifdef WIN32
 	if (hFile_ != INVALID_HANDLE_VALUE) {
 		return 0;
@@ -24,7 +117,7 @@ int File::open() {
 		FILE_SHARE_READ | FILE_SHARE_WRITE,          // share mode
 		NULL,                     // security
 		OPEN_EXISTING,            // creation disposition
-		FILE_ATTRIBUTE_NORMAL,    // flags
+		direct ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL,    // flags
 		NULL                      // template file
 	);
 
@@ -36,10 +129,21 @@ int File::open() {
 		return 0;
 	}
 
-	fd_ = ::open(path_, O_RDONLY);
+	int flags = O_RDONLY;
+#ifdef O_DIRECT
+	if (direct) {
+		flags |= O_DIRECT;
+	}
+#endif
+	fd_ = ::open(path_, flags);
 	if (fd_ == -1) {
 		return -1;
 	}
+#ifdef __APPLE__
+	if (direct) {
+		fcntl(fd_, F_NOCACHE, 1);
+	}
+#endif
 #endif
 	return 0;
 }
@@ -62,81 +166,243 @@ size_t File::size() const {
 #endif
 }
 
+int64_t File::mtime() const {
+#ifdef WIN32
+	FILETIME write_time;
+	if (!GetFileTime(hFile_, NULL, NULL, &write_time)) {
+		return -1;
+	}
+
+	// 100ns intervals
+	return (((int64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime) * 100;
+#else
+	struct stat sb;
+	if (fstat(fd_, &sb) == -1) {
+		return -2;
+	}
+
+	return (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+#endif
+}
+
+const char *File::path() const {
+	return path_;
+}
+
 int File::mmap() {
-	size_t current_size = size();
+	return mmap(size());
+}
 
-	if (current_size == mapped_size_) {
-		return 0; // Already mapped
+bool File::can_map_in_place(size_t size) const {
+	// NOTE: Windows never reserves ahead, so there a file that grew is always mapped again at a new address. Views have
+	//  to start on 64 KB boundaries, and one can't be extended or partly replaced, so the view holding the end of the
+	//  old data couldn't be swapped for a longer one without unmapping it under concurrent readers.
+	return mapped_data_ && size >= mapped_size_ && size <= reserved_size_;
+}
+
+#ifndef WIN32
+int File::reserve(size_t size, const uint8_t *&data, size_t &reserved_size) {
+	// NOTE: Reserving address space is free, so leave plenty of headroom for the file to grow. An inaccessible,
+	//  unreserved anonymous mapping doesn't count towards the commit limit either.
+	static constexpr size_t MIN_RESERVE_SIZE = sizeof(void *) == 8 ? 64ULL * 1024 * 1024 * 1024 : 0;
+	for (size_t reserve_size : {std::max(MIN_RESERVE_SIZE, size * 2), size}) {
+		void *addr = ::mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr != MAP_FAILED) {
+			data = (const uint8_t*)addr;
+			reserved_size = reserve_size;
+			return 0;
+		}
 	}
+	return -1;
+}
+#endif
 
-	mapped_size_ = current_size;
+int File::mmap(size_t size) {
+	Mapping retired {};
+	const int ret = mmap(size, retired);
+	unmap(retired);
+	return ret;
+}
 
-#ifdef WIN32
-	if (hMap_ != INVALID_HANDLE_VALUE) {
-		UnmapViewOfFile(hMap_);
-		CloseHandle(hMap_);
-		hMap_ = INVALID_HANDLE_VALUE;
+int File::mmap(size_t size, Mapping &retired) {
+	if (size == mapped_size_) {
+		return 0; // Already mapped
+	}
+	if (size == 0) {
+		// Empty files can't be mapped
+		unmap();
+		return 0;
 	}
 
-	hMap_ = CreateFileMappingA(
+#ifdef WIN32
+	// NOTE: Always moves, see can_map_in_place()
+	HANDLE map = CreateFileMappingA(
 		hFile_,                    // file handle
 		NULL,                     // security
 		PAGE_READONLY,            // protection
-		mapped_size_ >> 32,         // maximum size high
-		mapped_size_ & 0xFFFFFFFF,       // maximum size low
+		size >> 32,               // maximum size high
+		size & 0xFFFFFFFF,        // maximum size low
 		NULL                      // mapping name
 	);
 
-	if (!hMap_) {
+	if (!map) {
 		return -1;
 	}
 
-	mapped_data_ = (const uint8_t*)MapViewOfFile(
-		hMap_,                     // mapping handle
+	auto data = (const uint8_t*)MapViewOfFile(
+		map,                      // mapping handle
 		FILE_MAP_READ,            // desired access
 		0, 0,                     // offset
 		0                         // size (0 = full file)
 	);
 
-	if (!mapped_data_) {
-		CloseHandle(hMap_);
+	if (!data) {
+		CloseHandle(map);
 		return -2;
 	}
+
+	retired = {mapped_data_, mapped_size_, hMap_};
+	mapped_data_ = data;
+	hMap_ = map;
+	mapped_size_ = size;
 #else
-	if (mapped_data_ && mapped_data_ != MAP_FAILED) {
-		::munmap((void*)mapped_data_, mapped_size_);
-		mapped_data_ = nullptr;
+	const uint8_t *data = mapped_data_;
+	size_t reserved_size = reserved_size_;
+	size_t mapped_size = mapped_size_;
+	const bool move = !can_map_in_place(size);
+	if (move) {
+		// The file shrank or outgrew the reservation, so start over at a new address
+		if (reserve(size, data, reserved_size) != 0) {
+			return -1;
+		}
+		mapped_size = 0;
 	}
 
-	mapped_data_ = (const uint8_t*)::mmap(NULL, mapped_size_, PROT_READ, MAP_SHARED, fd_, 0);
-	if (mapped_data_ == MAP_FAILED) {
-		return -1;
+	// Only map the pages past the current mapping. The last, partially mapped page is mapped again so it covers the new
+	//  data too, which is safe for concurrent readers as both mappings share the same page cache.
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t start = mapped_size & ~(page_size - 1);
+	int flags = MAP_SHARED | MAP_FIXED;
+#ifdef MAP_POPULATE
+	if (map_options().populate) {
+		flags |= MAP_POPULATE;
 	}
+#endif
+	void *addr = ::mmap((void*)(data + start), size - start, PROT_READ, flags, fd_, start);
+	if (addr == MAP_FAILED) {
+		if (move) {
+			::munmap((void*)data, reserved_size);
+		}
+		return -2;
+	}
+	if (move) {
+		guard(data, reserved_size);
+		retired = {mapped_data_, reserved_size_};
+		mapped_data_ = data;
+		reserved_size_ = reserved_size;
+	}
+	mapped_size_ = size;
+	advise_mapping(start, size - start);
 #endif
 	return 0;
 }
 
-void File::close() {
+void File::unmap(const Mapping &mapping) {
 #ifdef WIN32
-	if (hMap_ != INVALID_HANDLE_VALUE) {
-		UnmapViewOfFile(hMap_);
-		CloseHandle(hMap_);
-		hMap_ = INVALID_HANDLE_VALUE;
+	if (mapping.data) {
+		UnmapViewOfFile(mapping.data);
+	}
+	if (mapping.map != INVALID_HANDLE_VALUE) {
+		CloseHandle(mapping.map);
+	}
+#else
+	if (mapping.data) {
+		unguard(mapping.data);
+		// NOTE: Unmaps the file together with the rest of the reservation
+		::munmap((void*)mapping.data, mapping.size);
 	}
+#endif
+}
+
+void File::unmap() {
+#ifdef WIN32
+	unmap({mapped_data_, mapped_size_, hMap_});
+	hMap_ = INVALID_HANDLE_VALUE;
+#else
+	unmap({mapped_data_, reserved_size_});
+	reserved_size_ = 0;
+#endif
+	mapped_data_ = nullptr;
+	mapped_size_ = 0;
+}
+
+void File::close() {
+	unmap();
+#ifdef WIN32
 	if (hFile_ != INVALID_HANDLE_VALUE) {
 		CloseHandle(hFile_);
 		hFile_ = INVALID_HANDLE_VALUE;
 	}
 #else
-	if (mapped_data_ && mapped_data_ != MAP_FAILED) {
-		::munmap((void*)mapped_data_, mapped_size_);
-		mapped_data_ = nullptr;
-	}
 	::close(fd_);
 	fd_ = -1;
 #endif
 }
 
+bool File::is_replaced() const {
+#ifdef WIN32
+	BY_HANDLE_FILE_INFORMATION open_info;
+	if (!GetFileInformationByHandle(hFile_, &open_info)) {
+		return false;
+	}
+	HANDLE hPath = CreateFileA(path_, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hPath == INVALID_HANDLE_VALUE) {
+		// NOTE: Renamed away, but not replaced yet. Keep following the open file until it is.
+		return false;
+	}
+	BY_HANDLE_FILE_INFORMATION path_info;
+	const bool ok = GetFileInformationByHandle(hPath, &path_info);
+	CloseHandle(hPath);
+	return ok && (path_info.dwVolumeSerialNumber != open_info.dwVolumeSerialNumber
+		|| path_info.nFileIndexHigh != open_info.nFileIndexHigh
+		|| path_info.nFileIndexLow != open_info.nFileIndexLow);
+#else
+	struct stat open_sb;
+	struct stat path_sb;
+	if (fstat(fd_, &open_sb) == -1 || stat(path_, &path_sb) == -1) {
+		// NOTE: Renamed away, but not replaced yet. Keep following the open file until it is.
+		return false;
+	}
+	return open_sb.st_dev != path_sb.st_dev || open_sb.st_ino != path_sb.st_ino;
+#endif
+}
+
+int File::seal(bool truncated) {
+#ifdef WIN32
+	// NOTE: Windows doesn't allow truncating a file while it's mapped, and doesn't reserve ahead
+	return 0;
+#else
+	if (!mapped_data_) {
+		return 0;
+	}
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t mapped_end = (mapped_size_ + page_size - 1) & ~(page_size - 1);
+	if (truncated) {
+		void *addr = ::mmap((void*)mapped_data_, mapped_end, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (addr == MAP_FAILED) {
+			return -1;
+		}
+	}
+	if (reserved_size_ > mapped_end) {
+		guard(mapped_data_, mapped_end);
+		::munmap((void*)(mapped_data_ + mapped_end), reserved_size_ - mapped_end);
+		reserved_size_ = mapped_end;
+	}
+	return 0;
+#endif
+}
+
 size_t File::mapped_size() const {
 	return mapped_size_;
 }
@@ -145,22 +411,156 @@ const uint8_t *File::mapped_data() const {
 	return mapped_data_;
 }
 
-void File::touch_pages(const uint8_t *addr, size_t size) {
+int64_t File::read(size_t offset, size_t length, uint8_t *buffer) const {
+	size_t done = 0;
+	while (done < length) {
+#ifdef WIN32
+		OVERLAPPED overlapped {};
+		overlapped.Offset = (DWORD)(offset + done);
+		overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+		DWORD n = 0;
+		const DWORD size = (DWORD)std::min<size_t>(length - done, 1ULL << 30);
+		if (!ReadFile(hFile_, buffer + done, size, &n, &overlapped)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) {
+				break;
+			}
+			return -1;
+		}
+#else
+		const size_t size = length - done;
+		const ssize_t n = ::pread(fd_, buffer + done, size, offset + done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+#endif
+		done += n;
+		// NOTE: Short reads from regular files only happen at the end. Carrying on would also break the alignment
+		//  needed for direct I/O.
+		if ((size_t)n < size) {
+			break;
+		}
+	}
+	return done;
+}
+
+void File::advise(Access access) {
+	access_ = access;
+#ifndef WIN32
+	if (fd_ != -1) {
+		// NOTE: Sets the readahead size of the file itself, which also applies to page faults in the mapping
+		static constexpr int FADVICE[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM};
+		posix_fadvise(fd_, 0, 0, FADVICE[(int)access]);
+	}
+	advise_mapping(0, mapped_size_);
+#endif
+}
+
+#ifndef WIN32
+void File::advise_mapping(size_t start, size_t size) const {
+	if (!mapped_data_ || size == 0) {
+		return;
+	}
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	assert((start & (page_size - 1)) == 0);
+	static constexpr int MADVICE[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM};
+	madvise((void*)(mapped_data_ + start), size, MADVICE[(int)access_]);
+#ifdef MADV_HUGEPAGE
+	if (map_options().hugepage) {
+		madvise((void*)(mapped_data_ + start), size, MADV_HUGEPAGE);
+	}
+#endif
+}
+#endif
+
+int File::evict() {
 #ifdef WIN32
-	SYSTEM_INFO si;
-	GetSystemInfo(&si);
-	size_t page_size = si.dwPageSize;
+	if (hFile_ == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	// NOTE: There's no call to drop a file from the cache, but opening it without buffering makes the cache manager
+	//  flush and purge the pages that aren't mapped, so that they don't get mixed up with the unbuffered reads
+	HANDLE hUncached = CreateFileA(path_, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING, NULL);
+	if (hUncached == INVALID_HANDLE_VALUE) {
+		return -2;
+	}
+	CloseHandle(hUncached);
+	return 0;
+#else
+	if (fd_ == -1) {
+		return -1;
+	}
+	return posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED) == 0 ? 0 : -2;
+#endif
+}
+
+size_t File::resident_size() const {
+#ifdef WIN32
+	if (!mapped_data_) {
+		return 0;
+	}
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	const size_t page_size = info.dwPageSize;
+	static constexpr size_t BATCH_PAGES = 4 * 1024;
+	PSAPI_WORKING_SET_EX_INFORMATION pages[BATCH_PAGES];
+	size_t resident = 0;
+
+	for (size_t offset = 0; offset < mapped_size_; offset += BATCH_PAGES * page_size) {
+		const size_t length = std::min(mapped_size_ - offset, BATCH_PAGES * page_size);
+		const size_t num_pages = (length + page_size - 1) / page_size;
+		for (size_t i = 0; i < num_pages; i++) {
+			pages[i].VirtualAddress = (void*)(mapped_data_ + offset + i * page_size);
+		}
+		if (!QueryWorkingSetEx(GetCurrentProcess(), pages, (DWORD)(num_pages * sizeof(pages[0])))) {
+			return 0;
+		}
+		for (size_t i = 0; i < num_pages; i++) {
+			if (pages[i].VirtualAttributes.Valid) {
+				resident += std::min(page_size, mapped_size_ - offset - i * page_size);
+			}
+		}
+	}
+	return resident;
+#else
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	// NOTE: Checked in batches, so that huge files don't need a huge vector
+	static constexpr size_t BATCH_PAGES = 64 * 1024;
+	unsigned char pages[BATCH_PAGES];
+	size_t resident = 0;
+
+	for (size_t offset = 0; offset < mapped_size_; offset += BATCH_PAGES * page_size) {
+		const size_t length = std::min(mapped_size_ - offset, BATCH_PAGES * page_size);
+		if (mincore((void*)(mapped_data_ + offset), length, pages) != 0) {
+			return 0;
+		}
+		const size_t num_pages = (length + page_size - 1) / page_size;
+		for (size_t i = 0; i < num_pages; i++) {
+			if (pages[i] & 1) {
+				resident += std::min(page_size, mapped_size_ - offset - i * page_size);
+			}
+		}
+	}
+	return resident;
+#endif
+}
 
+void File::prefetch(const uint8_t *addr, size_t size) {
+	if (size == 0) {
+		return;
+	}
+#ifdef WIN32
 	WIN32_MEMORY_RANGE_ENTRY range;
 	range.VirtualAddress = (void*)addr;
 	range.NumberOfBytes = size;
 	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
 #else
-    size_t page_size = sysconf(_SC_PAGESIZE);
-	madvise(addr, length, MADV_WILLNEED);
+	// madvise() needs a page aligned address
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	const uintptr_t start = (uintptr_t)addr & ~(page_size - 1);
+	madvise((void*)start, (uintptr_t)addr + size - start, MADV_WILLNEED);
 #endif
-	// for (size_t i = 0; i < size; i += page_size) {
-	// 	const volatile uint8_t dummy = addr[i];  // force page-in
-	// 	(void)dummy;
-	// }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #ifdef WIN32
 #include <windows.h>
@@ -7,27 +8,115 @@
 #endif
 
 class File {
+public:
+	// Expected access pattern, used to tune the kernel's readahead
+	enum class Access {
+		kNORMAL,
+		kSEQUENTIAL,
+		kRANDOM,
+	};
+
+	// Offsets, sizes and buffers of reads from a file opened for direct I/O must be multiples of this
+	static constexpr size_t DIRECT_ALIGNMENT = 4096;
+
+	// A mapping that mmap() replaced, which the caller unmaps once nothing reads from it anymore
+	struct Mapping {
+		const uint8_t *data {};
+		// Size of the whole address range, including any reservation past the mapped data
+		size_t size {};
+#ifdef WIN32
+		HANDLE map = INVALID_HANDLE_VALUE;
+#endif
+	};
+
+private:
 	const char *path_;
 	size_t mapped_size_ {};
 	const uint8_t *mapped_data_ {};
+	// Size of the address range reserved at mapped_data_. The mapping grows in place until it reaches this size. Always 0
+	//  on Windows.
+	size_t reserved_size_ {};
+	Access access_ {Access::kNORMAL};
 #ifdef WIN32
 	HANDLE hFile_ = INVALID_HANDLE_VALUE;
 	HANDLE hMap_ = INVALID_HANDLE_VALUE;
 #else
 	int fd_ = -1;
-#endif
 
+	static int reserve(size_t size, const uint8_t *&data, size_t &reserved_size);
+	void advise_mapping(size_t start, size_t size) const;
+#endif
+	void unmap();
 
 public:
 	explicit File(const char *path);
 
-	int open();
+	// direct bypasses the page cache (O_DIRECT). The file can then only be read(), not mapped.
+	int open(bool direct = false);
 	size_t size() const;
+	// Last modification time, in nanoseconds since an unspecified epoch
+	int64_t mtime() const;
+	const char *path() const;
 	int mmap();
+	// Maps the first size bytes of the file. If can_map_in_place(size), mapped_data() does not change, and existing
+	//  pointers into the mapping stay valid throughout.
+	int mmap(size_t size);
+	// Same, but if the mapping has to move, the old one is handed out in retired rather than unmapped, so pointers into
+	//  it stay valid until File::unmap(retired). The new mapping is complete before mapped_data() switches to it.
+	int mmap(size_t size, Mapping &retired);
+	static void unmap(const Mapping &mapping);
+	bool can_map_in_place(size_t size) const;
 	void close();
 
 	size_t mapped_size() const;
 	const uint8_t *mapped_data() const;
+	// Reads without mapping the file. Returns the number of bytes read, which is only short at the end of the file, or
+	//  a negative number on error.
+	int64_t read(size_t offset, size_t length, uint8_t *buffer) const;
+
+	// Whether path now names a different file than the one that's open, e.g. because the open one was rotated away
+	bool is_replaced() const;
+	// Stops the mapping from growing, and releases the address space reserved for that. If the file was truncated, the
+	//  mapped data is also replaced with zeros: it's gone either way. Until then, reading the truncated part of the
+	//  mapping reads zeros a page at a time, rather than raising SIGBUS.
+	int seal(bool truncated);
+
+	// Applies to the whole file, including data mapped later
+	void advise(Access access);
+	// Drops the file's pages from the page cache, so that the next read comes from storage. Pages that are dirty, or
+	//  mapped by any process, stay cached. The file must be open, but doesn't need to be mapped.
+	int evict();
+	// Number of bytes of the mapping that are currently in the page cache. Windows can only tell which pages are in this
+	//  process' working set, so there it's a lower bound: cached pages that the mapping hasn't touched yet don't count.
+	size_t resident_size() const;
+	// Starts reading the given part of the mapping into the page cache in the background
+	static void prefetch(const uint8_t *addr, size_t size);
+};
+
+// Keeps the pages ahead of a sequential scan in flight, so the scan doesn't stall every time it runs past the kernel's
+//  readahead window. Concurrent scans of different parts of a file should each have their own.
+class ReadAhead {
+	static constexpr size_t DEFAULT_WINDOW = 32ULL * 1024 * 1024;
+
+	const uint8_t *data_;
+	size_t end_;
+	size_t window_;
+	size_t prefetched_;
+
+public:
+	ReadAhead(const uint8_t *data, size_t start, size_t end, size_t window = DEFAULT_WINDOW)
+		: data_(data), end_(end), window_(window), prefetched_(start) {
+		advance(start);
+	}
 
-	static void touch_pages(const uint8_t *addr, size_t size);
+	// Call whenever the scan reaches pos. Prefetches half a window at a time, so there's always at least that much in
+	//  flight without issuing a syscall per chunk. Does nothing if data is nullptr, i.e. the data isn't mapped.
+	void advance(size_t pos) {
+		if (!data_ || prefetched_ >= end_ || pos + window_ / 2 < prefetched_) {
+			return;
+		}
+		const size_t until = std::min(end_, pos + window_);
+		File::prefetch(data_ + prefetched_, until - prefetched_);
+		prefetched_ = until;
+	}
 };
@@ -0,0 +1,242 @@
+#include "file_source.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/vfs.h>
+#endif
+
+const char *FileSource::name(Backend backend) {
+	static constexpr const char *NAMES[] = {"mmap", "pread", "direct"};
+	return NAMES[(int)backend];
+}
+
+// Whether path is on storage where page faults are slow, or the file may vanish from under a mapping
+static bool is_remote(const char *path) {
+#ifdef WIN32
+	char root[MAX_PATH];
+	if (GetVolumePathNameA(path, root, sizeof(root))) {
+		return GetDriveTypeA(root) == DRIVE_REMOTE;
+	}
+	return path[0] == '\\' && path[1] == '\\';
+#elif defined(__linux__)
+	struct statfs sb;
+	if (statfs(path, &sb) != 0) {
+		return false;
+	}
+	switch ((uint32_t)sb.f_type) {
+		case 0x6969:     // NFS
+		case 0x517B:     // SMB
+		case 0xFF534D42: // CIFS
+		case 0xFE534D42: // SMB2
+		case 0x65735546: // FUSE
+		case 0x00C36400: // Ceph
+		case 0x01021997: // 9P
+			return true;
+		default:
+			return false;
+	}
+#else
+	return false;
+#endif
+}
+
+FileSource::Backend FileSource::default_backend(const char *path) {
+	if (const char *io = getenv("LOG_VIEWER_IO"); io && *io) {
+		for (Backend backend : {Backend::kMMAP, Backend::kPREAD, Backend::kDIRECT}) {
+			if (strcmp(io, name(backend)) == 0) {
+				return backend;
+			}
+		}
+		std::cerr << "Unknown LOG_VIEWER_IO=" << io << ", expected mmap, pread or direct\n";
+	}
+	return is_remote(path) ? Backend::kPREAD : Backend::kMMAP;
+}
+
+FileSource::FileSource(const char *path, Backend backend) : path_(path), backend_(backend) {
+	generations_.push_back({File {path}, 0, 0});
+}
+
+void FileSource::close() {
+	for (auto &generation : generations_) {
+		generation.file.close();
+	}
+}
+
+size_t FileSource::length(const Generation &generation) const {
+	return backend_ == Backend::kMMAP ? generation.file.mapped_size() : generation.length;
+}
+
+bool FileSource::rotated() const {
+	const File &file = current().file;
+	return file.size() < length(current()) || file.is_replaced();
+}
+
+bool FileSource::can_update_in_place(size_t length) const {
+	if (rotated()) {
+		return false;
+	}
+	// NOTE: Data that's read rather than mapped never moves
+	return backend_ != Backend::kMMAP || current().file.can_map_in_place(length - current().start);
+}
+
+int FileSource::map(File &file, size_t size) {
+	File::Mapping retired {};
+	const int ret = file.mmap(size, retired);
+	if (retired.data) {
+		retire([retired] { File::unmap(retired); });
+	}
+	return ret;
+}
+
+int FileSource::rotate() {
+	Generation &generation = generations_.back();
+	File &file = generation.file;
+	const bool truncated = !file.is_replaced();
+	if (!truncated && file.size() > length(generation)) {
+		// Pick up whatever was written to the old file before it was replaced
+		if (backend_ != Backend::kMMAP) {
+			generation.length = file.size();
+		} else if (int ret = map(file, file.size()); ret != 0) {
+			return ret;
+		}
+	}
+	// NOTE: Between the truncation and this, reading the old data through the mapping faults, and File maps zeros over
+	//  the faulting pages
+	if (int ret = file.seal(truncated); ret != 0) {
+		return ret;
+	}
+
+	const size_t start = length();
+	File next {path_};
+	if (next.open(backend_ == Backend::kDIRECT) != 0) {
+		return -10;
+	}
+	std::cout << "Rotated " << path_ << (truncated ? " (truncated)" : " (replaced)") << " at " << start << " B\n";
+	generations_.push_back({next, start, 0});
+	return 0;
+}
+
+int FileSource::update(size_t length) {
+	if (rotated()) {
+		if (int ret = rotate(); ret != 0) {
+			return ret;
+		}
+		// NOTE: length was based on the previous file, so take whatever the new one has instead
+		length = available();
+	}
+	Generation &generation = generations_.back();
+	const size_t size = std::max(length, generation.start) - generation.start;
+	if (backend_ != Backend::kMMAP) {
+		generation.length = std::min(size, generation.file.size());
+		return 0;
+	}
+	return map(generation.file, size);
+}
+
+const uint8_t *FileSource::data() const {
+	return backend_ == Backend::kMMAP && generations_.size() == 1 ? current().file.mapped_data() : nullptr;
+}
+
+const uint8_t *FileSource::read(size_t offset, size_t length, uint8_t *buffer) const {
+	// NOTE: The loader may add a generation meanwhile, but never one that contains offset
+	const size_t count = generations_.size();
+	// The generation containing offset
+	size_t generation = std::upper_bound(generations_.begin() + 1, generations_.begin() + count, offset,
+		[](size_t offset, const Generation &generation) { return offset < generation.start; }) - generations_.begin() - 1;
+	const bool last = generation + 1 == count;
+	if (backend_ == Backend::kMMAP) {
+		const Generation &g = generations_[generation];
+		if (last || offset + length <= g.start + g.file.mapped_size()) {
+			return g.file.mapped_data() + (offset - g.start);
+		}
+	}
+
+	for (size_t done = 0; done < length; generation++) {
+		const Generation &g = generations_[generation];
+		const size_t pos = offset + done - g.start;
+		const size_t size = generation + 1 == count
+			? length - done : std::min(length - done, this->length(g) - pos);
+		if (size > 0 && !read(generation, pos, size, buffer + done)) {
+			// NOTE: E.g. a network filesystem that went away. Unlike a mapping, this doesn't bring the process down.
+			if (!reported_error_.test_and_set()) {
+				std::cerr << "Failed to read " << path_ << " at " << offset + done << ", showing zeros\n";
+			}
+			std::memset(buffer + done, 0, size);
+		}
+		done += size;
+	}
+	return buffer;
+}
+
+bool FileSource::read(size_t generation, size_t offset, size_t length, uint8_t *buffer) const {
+	const File &file = generations_[generation].file;
+	switch (backend_) {
+		case Backend::kMMAP:
+			std::memcpy(buffer, file.mapped_data() + offset, length);
+			return true;
+		case Backend::kPREAD:
+			return file.read(offset, length, buffer) == (int64_t)length;
+		case Backend::kDIRECT:
+			return read_direct(generation, offset, length, buffer);
+	}
+	return false;
+}
+
+bool FileSource::read_direct(size_t generation, size_t offset, size_t length, uint8_t *buffer) const {
+	const File &file = generations_[generation].file;
+	std::unique_lock lock(cache_mtx_);
+	for (size_t done = 0; done < length;) {
+		const size_t position = offset + done;
+		const size_t index = position / BLOCK_SIZE;
+		const size_t block_offset = position % BLOCK_SIZE;
+		const size_t n = std::min(length - done, BLOCK_SIZE - block_offset);
+
+		// NOTE: The last block of a growing file may have been cached before it was complete
+		auto it = std::find_if(cache_.begin(), cache_.end(), [&](const Block &block) {
+			return block.generation == generation && block.index == index && block.size >= block_offset + n;
+		});
+		if (it == cache_.end()) {
+			std::unique_ptr<uint8_t[], AlignedDelete> data {};
+			if (!free_.empty()) {
+				data = std::move(free_.back());
+				free_.pop_back();
+			} else {
+				data.reset(new (std::align_val_t {File::DIRECT_ALIGNMENT}) uint8_t[BLOCK_SIZE]);
+			}
+
+			// NOTE: Read outside the lock, so that threads reading different blocks don't wait on each other
+			lock.unlock();
+			const int64_t size = file.read(index * BLOCK_SIZE, BLOCK_SIZE, data.get());
+			lock.lock();
+			if (size < (int64_t)(block_offset + n)) {
+				free_.push_back(std::move(data));
+				return false;
+			}
+
+			// Replace an older version of the block, or the least recently used one if the cache is full
+			it = std::find_if(cache_.begin(), cache_.end(), [&](const Block &block) {
+				return block.generation == generation && block.index == index;
+			});
+			if (it == cache_.end() && cache_.size() >= CACHE_BLOCKS) {
+				it = std::min_element(cache_.begin(), cache_.end(), [](const Block &a, const Block &b) {
+					return a.last_use < b.last_use;
+				});
+			}
+			if (it == cache_.end()) {
+				it = cache_.insert(cache_.end(), Block {});
+			} else {
+				free_.push_back(std::move(it->data));
+			}
+			*it = {generation, index, (size_t)size, 0, std::move(data)};
+		}
+		it->last_use = ++clock_;
+		std::memcpy(buffer + done, it->data.get() + block_offset, n);
+		done += n;
+	}
+	return true;
+}
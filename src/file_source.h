@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "file.h"
+#include "segarray.h"
+#include "source.h"
+#include "Tracy.hpp"
+
+// A regular file, mapped into memory or read with pread().
+//
+// Survives log rotation. When the file is truncated, or the path is replaced by a new file (e.g. by logrotate), the
+//  current file is sealed as a generation of its own and the new file continues after it, so the line space stays
+//  continuous across rotations.
+class FileSource : public Source {
+public:
+	// How the file is read
+	enum class Backend {
+		// Mapped into memory. The fastest on local storage, but page faults on network and FUSE filesystems are slow
+		//  and stall whichever thread touches the data, and data that vanishes from under the mapping reads as zeros.
+		kMMAP,
+		// Read in chunks with pread(), through the page cache. Read errors just read as zeros.
+		kPREAD,
+		// pread() with O_DIRECT, bypassing the page cache, through a small cache of aligned blocks of our own
+		kDIRECT,
+	};
+
+	static const char *name(Backend backend);
+	// LOG_VIEWER_IO=mmap|pread|direct if set, otherwise pread for files on network and FUSE filesystems, and mmap for
+	//  everything else
+	static Backend default_backend(const char *path);
+
+private:
+	struct Generation {
+		File file;
+		// Offset of the file's first byte in the source
+		size_t start;
+		// Number of readable bytes, for backends that don't map the file
+		size_t length;
+	};
+
+	// Read size and alignment of the direct I/O block cache
+	static constexpr size_t BLOCK_SIZE = 1ULL * 1024 * 1024;
+	static constexpr size_t CACHE_BLOCKS = 16;
+
+	struct AlignedDelete {
+		void operator()(uint8_t *data) const { operator delete[](data, std::align_val_t {File::DIRECT_ALIGNMENT}); }
+	};
+
+	struct Block {
+		size_t generation;
+		size_t index;
+		size_t size;
+		uint64_t last_use;
+		std::unique_ptr<uint8_t[], AlignedDelete> data;
+	};
+
+	const char *path_;
+	const Backend backend_;
+	// NOTE: The last generation is the current file. Earlier ones are kept open (and mapped), so the lines indexed from
+	//  them stay readable, but never change again. Generations never move, so update() can add one while others read.
+	segarray<Generation, 2> generations_ {};
+
+	// NOTE: Only used by the direct backend
+	mutable TracyLockable(std::mutex, cache_mtx_);
+	mutable std::vector<Block> cache_ {};
+	// Buffers of evicted blocks, to be reused
+	mutable std::vector<std::unique_ptr<uint8_t[], AlignedDelete>> free_ {};
+	mutable uint64_t clock_ {};
+	mutable std::atomic_flag reported_error_ {};
+
+	const Generation &current() const { return generations_.back(); }
+	size_t length(const Generation &generation) const;
+	// Maps the first size bytes of file. A mapping that moves is retired, as snapshots may still point into it.
+	int map(File &file, size_t size);
+	int rotate();
+	// Copies [offset, offset + length) of a generation into buffer. Returns false on read errors.
+	bool read(size_t generation, size_t offset, size_t length, uint8_t *buffer) const;
+	bool read_direct(size_t generation, size_t offset, size_t length, uint8_t *buffer) const;
+
+	FileSource() = delete;
+	FileSource(const FileSource &) = delete;
+	FileSource &operator=(const FileSource &) = delete;
+	FileSource(FileSource &&) = delete;
+	FileSource &operator=(FileSource &&) = delete;
+
+public:
+	FileSource(const char *path, Backend backend);
+	~FileSource() override = default;
+
+	Backend backend() const { return backend_; }
+
+	int open() override { return generations_.back().file.open(backend_ == Backend::kDIRECT); }
+	void close() override;
+	const char *path() const override { return path_; }
+	int64_t mtime() const override { return current().file.mtime(); }
+
+	size_t available() const override { return current().start + current().file.size(); }
+	bool rotated() const override;
+	bool can_update_in_place(size_t length) const override;
+	int update(size_t length) override;
+	size_t length() const override { return current().start + length(current()); }
+
+	// NOTE: Only contiguous until the first rotation, and only if mapped
+	const uint8_t *data() const override;
+	const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const override;
+
+	void advise(File::Access access) override { generations_.back().file.advise(access); }
+};
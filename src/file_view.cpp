@@ -24,7 +24,7 @@ void FileView::FindContext::reset() {
 	next_line_idx_ = 0;
 }
 
-void FileView::FindContext::feed(const dynarray<size_t> &line_starts, const dynarray<Finder::Job::Result> &results) {
+void FileView::FindContext::feed(const LineIndex &line_starts, const MatchIndex &results) {
 	const size_t num_lines = line_starts.size();
 
 	// O(N + M) linear scan.
@@ -36,7 +36,6 @@ void FileView::FindContext::feed(const dynarray<size_t> &line_starts, const dyna
 		while (1) {
 			assert(next_line_idx_ < num_lines);
 			if (result.start < line_starts[next_line_idx_]) {
-				// TODO this can block during realloc
 				line_indices.push_back(next_line_idx_ - 1);
 				break;
 			}
@@ -102,16 +101,12 @@ void FileView::FindContext::feed(const dynarray<size_t> &line_starts, const dyna
 // 	filtered_line_indices_.resize_uninitialized(0);
 // }
 
-std::unique_ptr<FileView> FileView::create(Widget *parent, const char *path) {
-	return std::unique_ptr<FileView>(new FileView(parent, path));
+std::unique_ptr<FileView> FileView::create(Widget *parent, const std::vector<const char *> &paths) {
+	return std::unique_ptr<FileView>(new FileView(parent, paths));
 }
 
-FileView::FileView(Widget *parent, const char *path)
-	: Widget(parent, "FV"), loader_(File{path}, dataset_, [this]{on_new_lines();}) {
-
-	line_starts_.resize_uninitialized(2);
-	line_starts_[0] = 0; // Start of the file
-	line_starts_[1] = 0; // End of the file (will be updated later)
+FileView::FileView(Widget *parent, const std::vector<const char *> &paths)
+	: Widget(parent, "FV"), loader_(Source::create(paths), dataset_, [this]{on_new_lines();}), line_starts_(loader_.user().line_starts()) {
 
 	add_child(linenum_view_);
 	add_child(content_view_);
@@ -241,6 +236,9 @@ void FileView::on_findview_event(FindView &view, FindView::Event event) {
 			assert(state.total_matches > 0);
 
 			auto user = finder_.user();
+			auto loader_user = loader_.user();
+			// NOTE: Matches are only found in the indexed part of the file
+			leave_preview(loader_user);
 			auto &job = user.jobs().at(&view);
 			const auto &results = job->results();
 
@@ -324,6 +322,54 @@ void FileView::scroll_to(ivec2 pos, bool allow_autoscroll) {
 	soil();
 }
 
+void FileView::scroll_to_fraction(double fraction) {
+	if (preview_) {
+		// NOTE: Lines past the preview aren't indexed yet, so have the loader preview the lines around that offset
+		loader_.request_preview(fraction * dataset_.user().readable_length());
+		autoscroll_ = false;
+		return;
+	}
+	scroll_to({scroll_.x, fraction * max_scroll().y}, true);
+}
+
+void FileView::update_preview(const InputProcessor::User &loader_user, std::shared_ptr<const InputProcessor::Preview> &&preview, size_t length) {
+	if (preview != preview_) {
+		// Keep the same line at the top when switching to or from a preview, which reconciles its estimated line
+		//  numbers with the exact ones. A new preview starts at the line it was requested for instead.
+		const int line_height = TextShader::font().size.y;
+		const size_t top_line = std::min<size_t>(std::max(0, scroll_.y / line_height), lines_->size() - 1);
+		size_t anchor = (*lines_)[top_line];
+		if (preview && preview->target != InputProcessor::Preview::TAIL) {
+			anchor = preview->target;
+		}
+
+		preview_ = std::move(preview);
+		lines_ = preview_ ? &preview_->line_starts : &line_starts_;
+		size_t line_idx = lines_->lower_bound(anchor);
+		if (line_idx >= lines_->size() || (line_idx > 0 && (*lines_)[line_idx] > anchor)) {
+			line_idx--;
+		}
+		scroll_.y = line_idx * line_height + std::max(0, scroll_.y % line_height);
+		need_buffer_update_ = true;
+	}
+
+	num_lines_ = lines_->size() - 1;
+	longest_line_ = loader_user.longest_line();
+	if (preview_) {
+		longest_line_ = std::max(longest_line_, preview_->longest_line);
+		first_line_number_ = loader_user.estimate_line(preview_->line_starts[0]);
+		estimated_num_lines_ = std::max(first_line_number_ + num_lines_, loader_user.estimate_line(length));
+	} else {
+		first_line_number_ = 0;
+		estimated_num_lines_ = num_lines_;
+	}
+}
+
+void FileView::leave_preview(const InputProcessor::User &loader_user) {
+	show_preview_ = false;
+	update_preview(loader_user, nullptr, 0);
+}
+
 void FileView::scroll(dvec2 scroll) {
 	auto max = max_scroll();
 
@@ -355,14 +401,13 @@ static size_t linenum_len(size_t line) {
 }
 
 size_t FileView::get_line_len(size_t line_idx) const {
-	assert(line_idx < line_starts_.size() - 1);
-	return line_starts_[line_idx + 1] - line_starts_[line_idx];
+	assert(line_idx < num_lines_);
+	return (*lines_)[line_idx + 1] - (*lines_)[line_idx];
 }
 
 size_t FileView::num_lines() const {
 	// last entry in line_starts_ is the end of the file (even if it's not a newline character), so we don't count it
-	assert(line_starts_.size() >= 2);
-	return line_starts_.size() - 1;
+	return num_lines_;
 }
 
 size_t FileView::num_filtered_lines() const {
@@ -406,8 +451,8 @@ size_t FileView::abs_char_loc_to_abs_char_idx(ivec2 abs_loc) const {
 	if (abs_loc.y < 0) {
 		return 0;
 	}
-	abs_loc.y = std::min(abs_loc.y, (int)line_starts_.size() - 1);
-	return line_starts_[abs_loc.y] + abs_loc.x;
+	abs_loc.y = std::min(abs_loc.y, (int)num_lines_);
+	return (*lines_)[abs_loc.y] + abs_loc.x;
 }
 
 size_t FileView::abs_char_idx_to_buf_char_idx(size_t abs_idx) const {
@@ -440,7 +485,7 @@ size_t FileView::abs_char_loc_to_buf_char_idx(ivec2 abs_loc) const {
 // 	line_filter_.update();
 // }
 
-void FileView::really_update_buffers(const uint8_t *data) {
+void FileView::really_update_buffers(const Dataset::User &user) {
 	ZoneScopedN("Update buffer");
 	// TracyGpuZone("Update buffer");
 	// Timeit update_timeit("Update buffer");
@@ -454,7 +499,12 @@ void FileView::really_update_buffers(const uint8_t *data) {
 	size_t content_num_chars = 0;
 	size_t linenum_num_chars = 0;
 	char linenum_text[linenum_view_.linenum_chars_ + 1]; // +1 for the null terminator added by sprintf
-	const std::string fmt = "%" + std::to_string(linenum_view_.linenum_chars_) + "zu";
+	// NOTE: Line numbers in a preview are estimates
+	const std::string fmt = preview_
+		? "~%" + std::to_string(linenum_view_.linenum_chars_ - 1) + "zu"
+		: "%" + std::to_string(linenum_view_.linenum_chars_) + "zu";
+	// Visible part of the current line, if the data isn't mapped into memory
+	uint8_t line_buffer[MAX_VISIBLE_CHARS.x];
 
 	for (int buf_line_idx = std::max(0, content_view_.buf_char_window_.tl.y); buf_line_idx < std::clamp(content_view_.buf_char_window_.br.y, 0, (int)num_lines()); ++buf_line_idx) {
 		size_t line_idx;
@@ -468,9 +518,19 @@ void FileView::really_update_buffers(const uint8_t *data) {
 		}
 
 		int line_len = get_line_len(line_idx);
-		size_t linenum_len = sprintf(linenum_text, fmt.c_str(), line_idx + 1);
-
-		for (int char_idx = std::max(0, content_view_.buf_char_window_.tl.x); char_idx < std::clamp(content_view_.buf_char_window_.br.x, 0, line_len); char_idx++) {
+		size_t linenum_len = sprintf(linenum_text, fmt.c_str(), first_line_number_ + line_idx + 1);
+
+		const size_t line_start = (*lines_)[line_idx];
+		const int first_char = std::max(0, content_view_.buf_char_window_.tl.x);
+		// NOTE: Lines are published before the dataset is extended, so the end of the last line may not be readable yet
+		const size_t length = preview_ ? user.readable_length() : user.length();
+		const int last_char = (int)std::min<size_t>(std::clamp(content_view_.buf_char_window_.br.x, 0, line_len),
+			length > line_start ? length - line_start : 0);
+		const uint8_t *chars = first_char < last_char
+			? user.peek(line_start + first_char, last_char - first_char, line_buffer) - first_char
+			: nullptr;
+
+		for (int char_idx = first_char; char_idx < last_char; char_idx++) {
 			uint8_t r = 200;
 			uint8_t g = 200;
 			uint8_t b = 200;
@@ -484,7 +544,7 @@ void FileView::really_update_buffers(const uint8_t *data) {
 				// vec4{100, 0, 0, 100}
 				vec4{},
 				{},
-				data[line_starts_[line_idx] + char_idx],
+				chars[char_idx],
 			};
 			content_num_chars++;
 		}
@@ -522,6 +582,34 @@ void FileView::really_update_buffers(const uint8_t *data) {
 	linenum_view_.soil();
 }
 
+void FileView::prefetch_buffer_lines(const uint8_t *data) const {
+	ZoneScopedN("Prefetch lines");
+	// NOTE: Pages that aren't cached yet would otherwise be faulted in one at a time while filling the buffer. Also
+	//  covers another buffer's worth of lines on either side, so that scrolling on from here doesn't stall either.
+	static constexpr size_t MAX_GAP = 4096;
+	const int margin = MAX_VISIBLE_CHARS.y;
+	const size_t first = std::max(0, content_view_.buf_char_window_.tl.y - margin);
+	size_t last = std::clamp(content_view_.buf_char_window_.br.y + margin, 0, (int)num_lines());
+	if (active_filter_) {
+		last = std::min(last, active_filter_->line_indices.size());
+	}
+
+	size_t begin = 0;
+	size_t end = 0;
+	for (size_t i = first; i < last; i++) {
+		const size_t line_idx = active_filter_ ? active_filter_->line_indices[i] : i;
+		const size_t line_start = (*lines_)[line_idx];
+		// Only the start of very long lines is ever rendered
+		const size_t line_end = std::min((*lines_)[line_idx + 1], line_start + MAX_VISIBLE_CHARS.x);
+		if (line_start > end + MAX_GAP) {
+			File::prefetch(data + begin, end - begin);
+			begin = line_start;
+		}
+		end = line_end;
+	}
+	File::prefetch(data + begin, end - begin);
+}
+
 bool FileView::update_buffers(const Dataset::User &user) {
 	if (num_lines() == 0) {
 		return false;
@@ -539,8 +627,9 @@ bool FileView::update_buffers(const Dataset::User &user) {
 
 	// TODO also run this when new lines are added and they're visible
 	// Check if the visible lines are already in the buffer
+	const bool jumped = !content_view_.buf_char_window_.contains(visible_char_window);
 	need_buffer_update_ |= true;
-	need_buffer_update_ |= !content_view_.buf_char_window_.contains(visible_char_window);
+	need_buffer_update_ |= jumped;
 	if (need_buffer_update_) {
 	// if (1) {
 		content_view_.buf_char_window_ = content_view_.buf_char_window_.from_center_size(
@@ -548,7 +637,11 @@ bool FileView::update_buffers(const Dataset::User &user) {
 			MAX_VISIBLE_CHARS
 		);
 		need_buffer_update_ = false;
-		really_update_buffers(user.data());
+		// NOTE: Compressed files aren't mapped, and keep their own cache of decoded blocks
+		if (jumped && user.data()) {
+			prefetch_buffer_lines(user.data());
+		}
+		really_update_buffers(user);
 		return true;
 	}
 	return false;
@@ -585,21 +678,23 @@ void FileView::update() {
 
 	auto dataset_user = dataset_.user();
 	auto finder_user = finder_.user();
-	loader_.get(line_starts_, longest_line_);
+	auto loader_user = loader_.user();
+	update_preview(loader_user, show_preview_ && !active_filter_ ? loader_user.preview() : nullptr, dataset_user.readable_length());
 
 	if (autoscroll_) {
 		// jump to the end of the file
 		scroll_.y = std::max(scroll_.y, max_visible_scroll().y);
 	}
 
-	linenum_view_.linenum_chars_ = linenum_len(num_lines());
+	linenum_view_.linenum_chars_ = preview_ ? linenum_len(estimated_num_lines_) + 1 : linenum_len(num_lines());
 
 	{
 		ZoneScopedN("Finder results");
 		for (const auto &[ctx_, job] : finder_user.jobs()) {
 			auto view = static_cast<FindView *>(ctx_);
 			const auto &results = job->results();
-			view->set_state({results.size(), view->state().current_match, false});
+			// NOTE: Patterns are compiled in the background, so a bad one only shows up here
+			view->set_state({results.size(), view->state().current_match, job->status() == Finder::Job::Status::kBAD_PATTERN});
 			find_ctxs_.at(view)->feed(line_starts_, results);
 
 			content_view_.stripe_view_.feed(view, line_starts_, find_ctxs_.at(view)->line_indices);
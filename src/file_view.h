@@ -19,14 +19,14 @@ class FileView : public Widget {
 	struct FindContext {
 		FindView view;
 		// Indices of the lines that contain one or more matches
-		dynarray<size_t> line_indices {};
+		segarray<size_t> line_indices {};
 		size_t next_match_idx_ {};
 		size_t next_line_idx_ {};
 
 		// TODO this is basically a copy of the FindView constructor, but the generic alternative is even uglier.
 		FindContext(Widget *parent, color color, std::function<void(FindView &, FindView::Event)> &&event_cb);
 		void reset();
-		void feed(const dynarray<size_t> &line_starts, const dynarray<Finder::Job::Result> &results);
+		void feed(const LineIndex &line_starts, const MatchIndex &results);
 	};
 
 	// class FilterContext {
@@ -46,7 +46,19 @@ class FileView : public Widget {
 	// };
 
 	InputProcessor loader_;
-	Dataset dataset_ {nullptr, nullptr};
+	// NOTE: Owned by loader_, and may only be read while holding loader_.user()
+	const LineIndex &line_starts_;
+	// Preview of a large file that's still loading, shown instead of line_starts_ (see InputProcessor::Preview)
+	std::shared_ptr<const InputProcessor::Preview> preview_ {};
+	// The lines being shown, either line_starts_ or the preview's
+	const LineIndex *lines_ {&line_starts_};
+	// Estimated number of the first line of a preview, 0 otherwise
+	size_t first_line_number_ {};
+	// Estimated number of lines in the whole file while previewing, for the scroll bar
+	size_t estimated_num_lines_ {};
+	// Cleared once the user jumps somewhere only the exact index can take them, e.g. a find result
+	bool show_preview_ {true};
+	Dataset dataset_ {nullptr};
 	Finder finder_ {dataset_};
 	LinenumView linenum_view_ {this};
 	ContentView content_view_ {this};
@@ -55,7 +67,8 @@ class FileView : public Widget {
 	glm::ivec2 scroll_ {};
 	glm::dvec2 frac_scroll_ {};
 
-	dynarray<size_t> line_starts_ {};
+	// Snapshots taken at the start of each update, so that they stay consistent for the whole frame
+	size_t num_lines_ {1};
 	// TODO need longest_filtered_line_ for the horizontal scrollbar
 	size_t longest_line_ {};
 
@@ -66,7 +79,7 @@ class FileView : public Widget {
 	bool autoscroll_ {true};
 	bool need_buffer_update_ {};
 
-	FileView(Widget *parent, const char *path);
+	FileView(Widget *parent, const std::vector<const char *> &paths);
 
 	void on_new_lines();
 	void on_findview_event(FindView &view, FindView::Event event);
@@ -75,8 +88,13 @@ class FileView : public Widget {
 	bool on_key(int key, int scancode, int action, Window::KeyMods mods) override;
 	void on_resize() override;
 
+	void update_preview(const InputProcessor::User &loader_user, std::shared_ptr<const InputProcessor::Preview> &&preview, size_t length);
+	void leave_preview(const InputProcessor::User &loader_user);
+	void scroll_to_fraction(double fraction);
 	// void update_filtered_lines();
-	void really_update_buffers(const uint8_t *data);
+	void really_update_buffers(const Dataset::User &user);
+	// Starts reading the lines around the buffer window into the page cache, after a jump to an unbuffered part of the file
+	void prefetch_buffer_lines(const uint8_t *data) const;
 	bool update_buffers(const Dataset::User &user);
 	void scroll_to(glm::ivec2 pos, bool allow_autoscroll);
 	// size_t get_line_start(size_t line_idx) const;
@@ -93,7 +111,7 @@ class FileView : public Widget {
 	void update() override;
 
 public:
-	static std::unique_ptr<FileView> create(Widget *parent, const char *path);
+	static std::unique_ptr<FileView> create(Widget *parent, const std::vector<const char *> &paths);
 	~FileView();
 
 	int open();
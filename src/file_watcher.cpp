@@ -0,0 +1,137 @@
+#include "file_watcher.h"
+
+#include <filesystem>
+#include <iostream>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+#include "Tracy.hpp"
+
+using namespace std::chrono;
+
+FileWatcher::FileWatcher(const Event &quit) : quit_(quit) {
+#ifdef __linux__
+	// Created up front, so that an interrupt() before watch() still wakes the first wait()
+	wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef __linux__
+	if (inotify_fd_ != -1) {
+		::close(inotify_fd_);
+	}
+	if (wake_fd_ != -1) {
+		::close(wake_fd_);
+	}
+#endif
+}
+
+int FileWatcher::watch(const char *path) {
+#ifdef __linux__
+	if (wake_fd_ == -1) {
+		return -1;
+	}
+	if (inotify_fd_ != -1) {
+		// Watching again, e.g. after the file was replaced
+		::close(inotify_fd_);
+	}
+
+	inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd_ == -1) {
+		std::cerr << "inotify unavailable, polling " << path << "\n";
+		return -2;
+	}
+
+	if (inotify_add_watch(inotify_fd_, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+		std::cerr << "Failed to watch " << path << ", polling instead\n";
+		::close(inotify_fd_);
+		inotify_fd_ = -1;
+		return -3;
+	}
+	// NOTE: The watch above follows the file itself, so it doesn't see a new file taking its place after a rotation.
+	//  Files being created in (or moved into) the directory do wake the loader up. Not fatal if it fails, the
+	//  fallback interval still catches rotations.
+	auto dir = std::filesystem::path(path).parent_path();
+	if (dir.empty()) {
+		dir = ".";
+	}
+	inotify_add_watch(inotify_fd_, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void FileWatcher::watch_interrupts() {
+	interrupts_only_ = true;
+}
+
+bool FileWatcher::is_notifying() const {
+#ifdef __linux__
+	return inotify_fd_ != -1;
+#else
+	return false;
+#endif
+}
+
+void FileWatcher::wait(bool changed) {
+	if (interrupts_only_) {
+		ZoneScopedN("FileWatcher::wait");
+#ifdef __linux__
+		pollfd fd {wake_fd_, POLLIN, 0};
+		poll(&fd, 1, -1);
+		uint64_t count;
+		[[maybe_unused]] auto ret = read(wake_fd_, &count, sizeof(count));
+#else
+		std::unique_lock lock(wake_mtx_);
+		wake_cv_.wait(lock, [this] { return woken_; });
+		woken_ = false;
+#endif
+		return;
+	}
+	if (!is_notifying()) {
+		poll_interval_ = changed ? MIN_POLL_INTERVAL : std::min(poll_interval_ * 2, MAX_POLL_INTERVAL);
+		quit_.wait(poll_interval_);
+		return;
+	}
+
+#ifdef __linux__
+	pollfd fds[] {
+		{inotify_fd_, POLLIN, 0},
+		{wake_fd_, POLLIN, 0},
+	};
+
+	{
+		ZoneScopedN("FileWatcher::wait");
+		if (poll(fds, 2, (int)NOTIFY_FALLBACK_INTERVAL.count()) <= 0) {
+			return;
+		}
+	}
+
+	// Drain everything that's queued. One wake-up is enough to pick up all the changes made so far.
+	alignas(inotify_event) char buf[4096];
+	while (read(inotify_fd_, buf, sizeof(buf)) > 0) {}
+	uint64_t count;
+	[[maybe_unused]] auto ret = read(wake_fd_, &count, sizeof(count));
+#endif
+}
+
+void FileWatcher::interrupt() {
+#ifdef __linux__
+	if (wake_fd_ != -1) {
+		const uint64_t one = 1;
+		[[maybe_unused]] auto ret = ::write(wake_fd_, &one, sizeof(one));
+	}
+#else
+	{
+		std::lock_guard lock(wake_mtx_);
+		woken_ = true;
+	}
+	wake_cv_.notify_all();
+#endif
+}
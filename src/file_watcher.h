@@ -0,0 +1,51 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "worker.h"
+
+// Waits for a file to change. On Linux this uses inotify, so appends are picked up as soon as they happen and an idle
+//  file costs nothing. Elsewhere (or if inotify is unavailable) it polls, backing off while the file is idle and
+//  dropping back to the minimum interval as soon as it grows again.
+class FileWatcher {
+	static constexpr std::chrono::milliseconds MIN_POLL_INTERVAL {1};
+	static constexpr std::chrono::milliseconds MAX_POLL_INTERVAL {1000};
+	// inotify doesn't see writes made by other hosts on network filesystems, so still check occasionally
+	static constexpr std::chrono::milliseconds NOTIFY_FALLBACK_INTERVAL {5000};
+
+	const Event &quit_;
+	std::chrono::milliseconds poll_interval_ {MIN_POLL_INTERVAL};
+	// Only interrupt() wakes wait() up
+	bool interrupts_only_ {};
+#ifdef __linux__
+	int inotify_fd_ = -1;
+	int wake_fd_ = -1;
+#else
+	std::mutex wake_mtx_;
+	std::condition_variable wake_cv_ {};
+	bool woken_ {};
+#endif
+
+	FileWatcher() = delete;
+	FileWatcher(const FileWatcher &) = delete;
+	FileWatcher &operator=(const FileWatcher &) = delete;
+	FileWatcher(FileWatcher &&) = delete;
+	FileWatcher &operator=(FileWatcher &&) = delete;
+
+public:
+	explicit FileWatcher(const Event &quit);
+	~FileWatcher();
+
+	// Returns 0 if change notifications are available for path, or non-zero if it will be polled. May be called again to
+	//  watch the file that replaced the previous one.
+	int watch(const char *path);
+	// Doesn't watch anything, for sources that call interrupt() themselves when they have new data
+	void watch_interrupts();
+	bool is_notifying() const;
+
+	// Blocks until the file may have changed, or until interrupt() is called or quit is set.
+	//  changed tells the watcher whether the previous wake-up found new data, to adapt the polling interval.
+	void wait(bool changed);
+	void interrupt();
+};
@@ -1,252 +1,776 @@
 #include <cassert>
+#include <climits>
 
 #include "finder.h"
 
 #include <TracyC.h>
 #include <hs/hs.h>
+#include "file.h"
 #include "util.h"
 #include "Tracy.hpp"
 
 using namespace std::chrono;
 
-Finder::Finder(Dataset &dataset) : dataset_(dataset) {}
+// NOTE: Hyperscan's HS_FLAG_CASELESS only folds ASCII, without HS_FLAG_UTF8
+static uint8_t fold_case(uint8_t c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+Finder::Finder(Dataset &dataset) : dataset_(dataset) {
+	dataset_.add_listener(this, [this] { schedule(); });
+}
 
 Finder::~Finder() {
+	dataset_.remove_listener(this);
 	stop();
+	close();
+	hs_free_scratch(scratch_);
 }
 
 void Finder::stop() {
-	std::lock_guard lock(jobs_mtx_);
-	jobs_.clear();
+	{
+		std::lock_guard lock(jobs_mtx_);
+		for (auto &[ctx, job] : jobs_) {
+			retire(std::move(job));
+		}
+		jobs_.clear();
+	}
+	schedule();
+	// NOTE: The pass lets go of the retired jobs at its next slice
+	{
+		std::unique_lock lock(schedule_mtx_);
+		schedule_cv_.wait(lock, [this] { return !scheduled_; });
+	}
+	std::lock_guard lock(cache_mtx_);
+	cache_.clear();
+	cache_size_ = 0;
 }
 
-std::unique_ptr<Finder::Job> Finder::Job::create(LockableBase(std::mutex) &results_mtx, Dataset &dataset, std::function<void(void*, size_t)> &&on_result,
-	void* ctx, std::string_view pattern, int flags, int &error) {
-	Timeit t("Finder::Job::create()");
-	hs_compile_error_t *compile_err;
-	hs_error_t err;
+void Finder::retire(std::unique_ptr<Job> &&job) {
+	std::lock_guard lock(schedule_mtx_);
+	std::erase(wanted_, job.get());
+	retired_.push_back(std::move(job));
+	changed_ = true;
+}
 
-	hs_database_t *db {};
-	hs_scratch_t *scratch {};
-	hs_stream_t *stream {};
+void Finder::cache(std::unique_ptr<Job> &&job) {
+	if (job->status_ == Job::Status::kERROR) {
+		return;
+	}
+	std::lock_guard lock(cache_mtx_);
+	const uint64_t rotations = dataset_.rotations();
+	std::erase_if(cache_, [&](const auto &cached) {
+		if (cached->rotations_ == rotations) {
+			return false;
+		}
+		cache_size_ -= cached->results_.memory_usage();
+		return true;
+	});
+	if (job->rotations_ != rotations) {
+		return;
+	}
+	cache_size_ += job->results_.memory_usage();
+	cache_.push_front(std::move(job));
+	while (cache_size_ > CACHE_BUDGET) {
+		cache_size_ -= cache_.back()->results_.memory_usage();
+		cache_.pop_back();
+	}
+}
 
-	// err = hs_compile_multi(expressions.data(), flags.data(), ids.data(),
-	//                        expressions.size(), mode, nullptr, &db, &compileErr);
+std::unique_ptr<Finder::Job> Finder::uncache(std::string_view pattern, int flags) {
+	std::lock_guard lock(cache_mtx_);
+	// NOTE: Results from before a rotation are stale. The pass drops those, see cache().
+	const uint64_t rotations = dataset_.rotations();
+	auto it = std::find_if(cache_.begin(), cache_.end(), [&](const auto &job) {
+		return job->pattern_ == pattern && job->flags_ == flags && job->rotations_ == rotations;
+	});
+	if (it == cache_.end()) {
+		return nullptr;
+	}
+	auto job = std::move(*it);
+	cache_.erase(it);
+	cache_size_ -= job->results_.memory_usage();
+	return job;
+}
 
-	int mode = HS_MODE_STREAM | HS_MODE_SOM_HORIZON_LARGE;
-	bool regex = flags & FLAG_REGEX;
-	flags &= ~FLAG_REGEX;
-	flags |= HS_FLAG_SOM_LEFTMOST;
+Finder::Job::Job(std::function<void(void*, size_t)> &&on_result, void* ctx, std::string_view pattern, int flags, uint64_t rotations)
+	: on_result_(std::move(on_result)), ctx_(ctx), pattern_(pattern), flags_(flags), rotations_(rotations) {
+}
 
-	if (regex) {
-		err = hs_compile(pattern.data(), flags, mode, NULL, &db, &compile_err);
-	} else {
-		err = hs_compile_lit(pattern.data(), flags, pattern.size(), mode, NULL, &db, &compile_err);
-	}
+bool Finder::has_work() const {
+	return changed_ || (!wanted_.empty() && dataset_.length() > stream_pos_);
+}
 
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to compile pattern \"%s\": %s\n",
-				pattern.data(), compile_err->message);
-		hs_free_compile_error(compile_err);
-		error = -1;
-		return nullptr;
+void Finder::schedule() {
+	std::lock_guard lock(schedule_mtx_);
+	if (scheduled_ || !has_work()) {
+		return;
 	}
+	scheduled_ = true;
+	WorkerPool::shared().push(WorkerPool::Priority::kSEARCH, "Finder::scan", cancel_, [this] { scan(); });
+}
 
-	// TODO verify constraints with hs_expression_info()
+void Finder::finish() {
+	// Carry on with the rest, or whatever was published or submitted meanwhile
+	std::lock_guard lock(schedule_mtx_);
+	if (has_work()) {
+		WorkerPool::shared().push(WorkerPool::Priority::kSEARCH, "Finder::scan", cancel_, [this] { scan(); });
+		return;
+	}
+	scheduled_ = false;
+	// NOTE: Notified with the lock held, as stop() may destroy the finder as soon as it can take it
+	schedule_cv_.notify_all();
+}
 
-	err = hs_alloc_scratch(db, &scratch);
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to allocate scratch space. Exiting.\n");
-		hs_free_database(db);
-		error = -2;
-		return nullptr;
+void Finder::update_members() {
+	ZoneScopedN("Finder::update_members()");
+	std::vector<Job *> wanted;
+	std::vector<std::unique_ptr<Job>> retired;
+	{
+		std::lock_guard lock(schedule_mtx_);
+		changed_ = false;
+		wanted = wanted_;
+		retired.swap(retired_);
 	}
 
-	err = hs_open_stream(db, 0, &stream);
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to open stream. Exiting.\n");
-		hs_free_scratch(scratch);
-		hs_free_database(db);
-		error = -3;
-		return nullptr;
+	auto searchable = [](Job *job) {
+		return job->status_ == Job::Status::kCOMPILING || job->status_ == Job::Status::kOK;
+	};
+	const bool added = std::any_of(wanted.begin(), wanted.end(), [&](Job *job) {
+		return searchable(job) && std::find(members_.begin(), members_.end(), job) == members_.end();
+	});
+	if (added) {
+		// NOTE: The pass starts over from wherever the job that's furthest behind is, which is the start for new ones, or
+		//  the end of the cached results for ones that were searched for before. The others skip what they've been
+		//  through already.
+		std::vector<const Job *> sources;
+		std::copy_if(members_.begin(), members_.end(), std::back_inserter(sources), [](Job *job) { return job; });
+		for (const auto &job : retired) {
+			sources.push_back(job.get());
+		}
+		{
+			// NOTE: Cached jobs are only ever freed by the pass, taking one out of the cache doesn't free it
+			std::lock_guard lock(cache_mtx_);
+			for (const auto &job : cache_) {
+				sources.push_back(job.get());
+			}
+		}
+
+		close();
+		members_.clear();
+		std::copy_if(wanted.begin(), wanted.end(), std::back_inserter(members_), searchable);
+		for (Job *job : members_) {
+			if (job->stream_pos_ == 0) {
+				narrow(*job, sources);
+			}
+		}
+		if (compile() != 0) {
+			fail();
+		}
+		stream_pos_ = 0;
+		if (!members_.empty()) {
+			stream_pos_ = (*std::min_element(members_.begin(), members_.end(), [](Job *a, Job *b) {
+				return a->stream_pos_ < b->stream_pos_;
+			}))->stream_pos_.load();
+		}
+	} else {
+		for (auto &member : members_) {
+			if (member && std::find(wanted.begin(), wanted.end(), member) == wanted.end()) {
+				member = nullptr;
+			}
+		}
+		if (std::all_of(members_.begin(), members_.end(), [](Job *job) { return !job; })) {
+			close();
+			members_.clear();
+		}
+	}
+	// NOTE: Nothing refers to the retired jobs anymore
+	for (auto &job : retired) {
+		cache(std::move(job));
 	}
+}
 
-	error = 0;
-	return std::unique_ptr<Job>(new Job(results_mtx, dataset, std::move(on_result), ctx, pattern, flags, db, scratch, stream));
+std::optional<size_t> Finder::refinement(const Job &from, const Job &job) {
+	// NOTE: Only literals for now. Telling whether a regular expression is stricter than another is a lot harder.
+	if (&from == &job || from.flags_ != job.flags_ || (job.flags_ & ~HS_FLAG_CASELESS) || from.pattern_.empty()) {
+		return {};
+	}
+	const bool caseless = job.flags_ & HS_FLAG_CASELESS;
+	auto it = std::search(job.pattern_.begin(), job.pattern_.end(), from.pattern_.begin(), from.pattern_.end(),
+		[caseless](char a, char b) { return caseless ? fold_case(a) == fold_case(b) : a == b; });
+	if (it == job.pattern_.end()) {
+		return {};
+	}
+	return it - job.pattern_.begin();
 }
 
-Finder::Job::Job(LockableBase(std::mutex) &result_mtx, Dataset &dataset, std::function<void(void*, size_t)> &&on_result,
-	void* ctx, std::string_view pattern, int flags, hs_database_t *db, hs_scratch_t *scratch, hs_stream_t *stream)
-	: thread_(&worker, this), result_mtx_(result_mtx), dataset_(dataset), on_result_(std::move(on_result)), ctx_(ctx)
-	, pattern_(pattern), flags_(flags), db_(db) , scratch_(scratch), stream_(stream) {
+void Finder::narrow(Job &job, const std::vector<const Job *> &sources) {
+	// NOTE: Whichever got furthest, as the pass has to search the rest anyway
+	const Job *from = nullptr;
+	size_t offset = 0;
+	for (const Job *source : sources) {
+		auto k = refinement(*source, job);
+		// NOTE: Results from before a rotation are stale
+		if (!k || source->stream_pos_ == 0 || source->rotations_ != job.rotations_) {
+			continue;
+		}
+		if (!from || source->stream_pos_ > from->stream_pos_ ||
+				(source->stream_pos_ == from->stream_pos_ && source->pattern_.size() > from->pattern_.size())) {
+			from = source;
+			offset = *k;
+		}
+	}
+	if (!from) {
+		return;
+	}
+
+	ZoneScopedN("Finder::narrow()");
+	// NOTE: Every match of the job has one of from's at offset, and all of from's that end before its checkpoint are
+	//  in its results already. So are the job's, as its matches end no earlier than the ones they contain.
+	const size_t checkpoint = from->stream_pos_;
+	const size_t count = from->results_.size();
+	const bool caseless = job.flags_ & HS_FLAG_CASELESS;
+	const std::string &pattern = job.pattern_;
+	auto user = dataset_.user();
+	dynarray<uint8_t> buffer;
+	buffer.resize_uninitialized(pattern.size());
+	dynarray<Job::Result> matches;
+	for (size_t i = 0; i < count; i++) {
+		const auto match = from->results_[i];
+		if (match.start < offset) {
+			continue;
+		}
+		const size_t start = match.start - offset;
+		const size_t end = start + pattern.size();
+		// NOTE: Literals' matches all have the same length, so they're ordered by end too
+		if (end > checkpoint) {
+			break;
+		}
+		const uint8_t *data = user.read(start, pattern.size(), buffer.data());
+		if (std::equal(pattern.begin(), pattern.end(), data, [caseless](char a, uint8_t b) {
+			return caseless ? fold_case(a) == fold_case(b) : (uint8_t)a == b;
+		})) {
+			matches.push_back({start, end});
+		}
+	}
+	job.results_.extend(matches);
+	job.stream_pos_ = checkpoint;
+	if (job.on_result_) {
+		job.on_result_(job.ctx_, job.last_report_);
+	}
+	job.last_report_ = job.results_.size();
 }
 
-Finder::Job::~Job() {
-	assert(stream_ && scratch_ && db_);
+int Finder::compile() {
+	ZoneScopedN("Finder::compile()");
+	// NOTE: Literals are escaped so that they can share a database with regular expressions
+	auto escape = [](std::string_view literal) {
+		std::string escaped;
+		for (uint8_t c : literal) {
+			char hex[5];
+			snprintf(hex, sizeof(hex), "\\x%02x", c);
+			escaped += hex;
+		}
+		return escaped;
+	};
 
-	{
-		Timeit t("Finder::Job::~Job()");
-		quit();
+	hs_compile_error_t *compile_err;
+	hs_error_t err;
+	std::vector<std::string> patterns;
+	std::vector<const char *> expressions;
+	std::vector<unsigned int> flags;
+	std::vector<unsigned int> ids;
+	for (Job *job : members_) {
+		if (!job->has_trigrams_) {
+			job->trigrams_ = TrigramIndex::required(job->pattern_, job->flags_ & FLAG_REGEX, job->flags_ & ~FLAG_REGEX);
+			job->has_trigrams_ = true;
+		}
+	}
+	while (true) {
+		if (members_.empty()) {
+			return 0;
+		}
+		patterns.clear();
+		expressions.clear();
+		flags.clear();
+		ids.clear();
+		for (const Job *job : members_) {
+			const bool regex = job->flags_ & FLAG_REGEX;
+			patterns.push_back(regex ? job->pattern_ : escape(job->pattern_));
+			flags.push_back((job->flags_ & ~FLAG_REGEX) | HS_FLAG_SOM_LEFTMOST);
+			ids.push_back(ids.size());
+		}
+		for (const auto &pattern : patterns) {
+			expressions.push_back(pattern.c_str());
+		}
+
+		int mode = HS_MODE_STREAM | HS_MODE_SOM_HORIZON_LARGE;
+		err = hs_compile_multi(expressions.data(), flags.data(), ids.data(), expressions.size(), mode, NULL, &db_, &compile_err);
+		if (err == HS_SUCCESS) {
+			break;
+		}
+		if (compile_err->expression < 0) {
+			fprintf(stderr, "ERROR: Unable to compile patterns: %s\n", compile_err->message);
+			hs_free_compile_error(compile_err);
+			return -1;
+		}
+		// Drop the offending pattern and try again with the rest
+		const auto bad = members_.begin() + compile_err->expression;
+		Job *job = *bad;
+		fprintf(stderr, "ERROR: Unable to compile pattern \"%s\": %s\n", job->pattern_.c_str(), compile_err->message);
+		hs_free_compile_error(compile_err);
+		members_.erase(bad);
+		job->status_ = Job::Status::kBAD_PATTERN;
+		if (job->on_result_) {
+			job->on_result_(job->ctx_, 0);
+		}
 	}
 
-	hs_close_stream(stream_, nullptr, nullptr, nullptr);
-	hs_free_scratch(scratch_);
-	hs_free_database(db_);
+	// NOTE: Only patterns whose matches have a bounded length can be searched for in ranges, see search_ranges()
+	max_width_ = 0;
+	for (size_t i = 0; i < expressions.size(); i++) {
+		hs_expr_info_t *info = nullptr;
+		if (hs_expression_info(expressions[i], flags[i], &info, &compile_err) != HS_SUCCESS) {
+			hs_free_compile_error(compile_err);
+			max_width_ = UINT_MAX;
+			break;
+		}
+		max_width_ = std::max(max_width_, info->max_width);
+		free(info);
+	}
+
+	err = hs_alloc_scratch(db_, &scratch_);
+	if (err != HS_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to allocate scratch space\n");
+		return -2;
+	}
+	for (Job *job : members_) {
+		job->status_ = Job::Status::kOK;
+	}
+	return 0;
 }
 
-void Finder::Job::quit()  {
-	std::cout << "Job quitting..." << std::endl;
-	quit_.test_and_set();
-	dataset_.notify();
+int Finder::open_stream() {
+	// NOTE: When carrying on after searching ranges, or from cached results, the stream starts a bit before, so that it
+	//  finds the matches that cross into the rest. Those that end before were reported already. Matches of unbounded
+	//  length could start anywhere, so then it has to start over.
+	stream_start_ = max_width_ <= MAX_OVERLAP ? stream_pos_ - std::min<size_t>(stream_pos_, max_width_) : 0;
+	stream_pos_ = stream_start_;
+	hs_error_t err = hs_open_stream(db_, 0, &stream_);
+	if (err != HS_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to open stream\n");
+		return -3;
+	}
+	return 0;
+}
 
-	if (thread_.joinable()) {
-		thread_.join();
+void Finder::close() {
+	if (stream_) {
+		hs_close_stream(stream_, nullptr, nullptr, nullptr);
+		stream_ = nullptr;
 	}
-	std::cout << "Job quit." << std::endl;
+	// NOTE: The scratch space is kept, hs_alloc_scratch() resizes it for the next database
+	hs_free_database(db_);
+	db_ = nullptr;
 }
 
-int Finder::Job::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
-	return static_cast<Job *>(context)->event_handler(id, from, to, flags);
+void Finder::fail() {
+	for (Job *job : members_) {
+		if (job) {
+			job->status_ = Job::Status::kERROR;
+		}
+	}
+	close();
+	members_.clear();
+}
+
+int Finder::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
+	return static_cast<Finder *>(context)->event_handler(id, from, to, flags);
 }
 
-int Finder::Job::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags) {
+int Finder::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags) {
 	// printf("Match found: id=%u, from=%llu, to=%llu, flags=%u, context=%p\n", id, from, to, flags, this);
 	// fflush(stdout);
 	// std::this_thread::sleep_for(milliseconds(1));
-	chunk_results_.emplace_back(from, to);
-	if (dataset_.is_update_pending() || quit_.test()) {
+	from += stream_start_;
+	to += stream_start_;
+	Job *job = members_[id];
+	// NOTE: Matches up to the job's stream_pos_ were reported by an earlier pass
+	if (job && to > job->stream_pos_) {
+		job->chunk_results_.emplace_back(from, to);
+	}
+	if (cancel_.is_cancelled()) {
 		return 1; // Stop matching
 	}
 	return 0; // Continue matching
 }
 
-void Finder::Job::worker() {
-	// TracyCSetThreadName(("Finder::Job " + std::to_string((uintptr_t)ctx_)).c_str());
-	tracy::SetThreadNameWithHint(("Finder::Job " + std::to_string((uintptr_t)ctx_)).c_str(), 1);
-	// NOTE Chunk size needs to be relatively small because it sets the latency of the quit event being handled
-	static constexpr size_t CHUNK_SIZE = 1ULL * 1024 * 1024;
+int Finder::range_event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
+	auto &range = *static_cast<Range *>(context);
+	from += range.spans[range.span].start;
+	to += range.spans[range.span].start;
+	const Job *job = range.finder.members_[id];
+	// NOTE: Matches that end in the overlap with a neighbour belong to that one
+	if (job && to > range.begin && to <= range.end && to > job->stream_pos_) {
+		range.results[id].emplace_back(from, to);
+	}
+	if (range.finder.cancel_.is_cancelled()) {
+		return 1; // Stop matching
+	}
+	return 0; // Continue matching
+}
 
-	while (true) {
-		std::cout << "Job acquire..." << std::endl;
-		{
-			auto user {dataset_.wait([this](auto length) {
-				return quit_.test() || length > stream_pos_;
-			})};
+size_t Finder::adapt_slice(size_t slice, size_t chunk_size, nanoseconds elapsed) {
+	// Aim for slices that take SLICE_TIME, so that changes are noticed quickly, whatever the patterns cost
+	const int64_t ns = std::max<int64_t>(1, elapsed.count());
+	const size_t target = (size_t)std::min<double>(MAX_SLICE, (double)chunk_size * duration_cast<nanoseconds>(SLICE_TIME).count() / ns);
+	return std::clamp((slice + target) / 2, MIN_SLICE, MAX_SLICE);
+}
 
-			if (quit_.test()) {
-				std::cout << "Quit event" << std::endl;
-				status_ = Status::kQUIT;
+void Finder::scan() {
+	if (changed_) {
+		update_members();
+	}
+	{
+		auto user = dataset_.user();
+		ZoneScopedN("Finder::scan()");
+		if (!db_) {
+			// Nothing to search for, or all the patterns are bad
+			stream_pos_ = std::max<size_t>(stream_pos_, user.length());
+		} else if (!stream_) {
+			// Starting over, or carrying on after searching ranges
+			if (search_index(user.length())) {
+				// NOTE: The pass carries on with whatever hasn't been indexed yet once the candidate blocks are done
+				return;
+			}
+			const size_t remaining = user.length() > stream_pos_ + LOOKAHEAD ? user.length() - stream_pos_ - LOOKAHEAD : 0;
+			const size_t num_ranges = max_width_ <= MAX_OVERLAP ? std::min(WorkerPool::shared().size(), remaining / MIN_RANGE_SIZE) : 0;
+			if (num_ranges > 1) {
+				// NOTE: The last range to finish carries on with the pass
+				search_ranges(stream_pos_, stream_pos_ + remaining, num_ranges);
+				return;
+			}
+			if (open_stream() != 0) {
+				fail();
+			}
+		}
+		const auto task_start = steady_clock::now();
+		ReadAhead read_ahead {user.data(), stream_pos_, user.length()};
+		for (size_t pos = stream_pos_; stream_ && pos < user.length() && !cancel_.is_cancelled() && !changed_;) {
+			const size_t chunk_size = std::min(user.length() - pos, slice_);
+			// NOTE: Sources that aren't mapped into memory (e.g. compressed files) are read a slice at a time
+			if (!user.data() && buffer_.size() < chunk_size) {
+				buffer_.resize_uninitialized(MAX_SLICE);
+			}
+			for (Job *job : members_) {
+				if (job) {
+					job->chunk_results_.resize_uninitialized(0);
+				}
+			}
+
+			const auto slice_start = steady_clock::now();
+			read_ahead.advance(pos);
+			const uint8_t *chunk = user.read(pos, chunk_size, buffer_.data());
+			hs_error_t err = hs_scan_stream(stream_, (const char*)chunk, chunk_size, 0, scratch_, event_handler, this);
+			if (err == HS_SCAN_TERMINATED) {
+				// Cancelled
+				break;
+			}
+			if (err != HS_SUCCESS) {
+				fprintf(stderr, "ERROR: Unable to scan input buffer\n");
+				fail();
 				break;
 			}
+			slice_ = adapt_slice(slice_, chunk_size, steady_clock::now() - slice_start);
+
+			pos += chunk_size;
+			stream_pos_ = pos;
+
+			for (Job *job : members_) {
+				// NOTE: A job that's ahead of the pass has already seen this slice
+				if (!job || job->stream_pos_ >= pos) {
+					continue;
+				}
+				{
+					// NOTE: Readers only see the new results once they're all written, no need to lock them out
+					ZoneScopedN("Extend results");
+					job->results_.extend(job->chunk_results_);
+				}
+				job->stream_pos_ = pos;
+				if (job->on_result_) {
+					job->on_result_(job->ctx_, job->last_report_);
+				}
+				job->last_report_ = job->results_.size();
+			}
 
-			ZoneScopedN("Finder::Job::worker()");
-			Timeit t("Scan");
-			std::cout << "Job acquired." << std::endl;
-			assert(user.data());
-			assert(user.length() > stream_pos_);
-
-			const uint8_t *data = user.data() + stream_pos_;
-			const size_t length = user.length() - stream_pos_;
-
-			hs_error_t err = HS_SUCCESS;
-		    for (size_t offset = 0; offset < length; offset += CHUNK_SIZE) {
-		        size_t chunk_size = std::min(length - offset, CHUNK_SIZE);
-	    		chunk_results_.resize_uninitialized(0);
-		    	// std::cout << "Job scan... " << offset << " - " << (offset + chunk_size) << " / " << length << std::endl;
-    			err = hs_scan_stream(stream_, (const char*)data + offset, chunk_size, 0, scratch_, event_handler, this);
-		    	// std::this_thread::sleep_for(milliseconds(100));
-		    	// std::cout << "Job scan = " << err << ". " << chunk_results_.size() << " results." << std::endl;
-
-			    if (quit_.test()) {
-		    		// Will be handled above
-					std::cout << "Quit during scan" << std::endl;
-			    }
-				if (err != HS_SUCCESS) {
-					break;
-		        }
-
-	    		stream_pos_ += chunk_size;
-
-			    {
-	        		std::unique_lock lock(result_mtx_);
-			        {
-				        ZoneScopedN("Extend results");
-		        		results_.extend(lock, chunk_results_);
-		        		// std::swap(results_, chunk_results_);
-			        }
-			    }
-		    	if (on_result_) {
-		    		on_result_(ctx_, last_report_);
-		    	}
-		    	last_report_ = results_.size();
-	    		chunk_results_.resize_uninitialized(0);
-
-		    	// if (dataset_.update_pending_.test()) {
-		    	// 	// Finder wants to update the dataset. Break out of the loop to release the lock earlier.
-		    	// 	break;
-		    	// }
-		    }
-
-			if (err == HS_SUCCESS) {
-
-			} else if (err == HS_SCAN_TERMINATED) {
-				// Will be handled above
-			} else {
-				status_ = Status::kERROR;
-				fprintf(stderr, "ERROR: Unable to scan input buffer. Exiting.\n");
+			if (steady_clock::now() - task_start >= TASK_TIME) {
 				break;
 			}
-			std::cout << "Job release...." << std::endl;
 		}
-		std::cout << "Job released." << std::endl;
 	}
+	finish();
 }
 
-Finder::Job::Status Finder::Job::status() const {
-	return status_;
+void Finder::search_ranges(size_t start, size_t end, size_t num_ranges) {
+	ZoneScopedN("Finder::search_ranges()");
+	// NOTE: A single stream is limited to one core, even when the data is in memory already. The ranges each get a
+	//  stream of their own, which starts max_width_ bytes early so that it sees every match that ends in the range.
+	const size_t range_size = (end - start + num_ranges - 1) / num_ranges;
+	std::vector<Range *> ranges;
+	{
+		std::lock_guard lock(ranges_mtx_);
+		for (size_t begin = start; begin < end; begin += range_size) {
+			const size_t range_end = std::min(end, begin + range_size);
+			ranges.push_back(add_range(begin, range_end, {{begin - std::min<size_t>(begin, max_width_), range_end + LOOKAHEAD}}));
+		}
+		next_range_ = 0;
+		ranges_left_ = ranges_.size();
+	}
+	for (Range *range : ranges) {
+		WorkerPool::shared().push(WorkerPool::Priority::kSEARCH, "Finder::scan_range", cancel_, [this, range] { scan_range(*range); });
+	}
 }
 
+Finder::Range *Finder::add_range(size_t begin, size_t end, std::vector<Span> &&spans) {
+	auto range = std::unique_ptr<Range>(new Range {*this, begin, end, std::move(spans)});
+	range->pos = range->spans.empty() ? 0 : range->spans.front().start;
+	range->slice = slice_;
+	range->results.resize(members_.size());
+	if (hs_open_stream(db_, 0, &range->stream) != HS_SUCCESS || hs_clone_scratch(scratch_, &range->scratch) != HS_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to set up range search.\n");
+	}
+	ranges_.push_back(std::move(range));
+	return ranges_.back().get();
+}
 
-int Finder::submit(void* ctx, std::function<void(void*, size_t)> &&on_result, std::string_view pattern, int flags) {
-	// NOTE This is called by the main thread (during search input box event handling) and should not block.
-	//  The only blocker here is erasing an existing job. Given how we have the quit flag set up, this will block until
-	//  the next match is found or the chunk is processed, whichever comes first.
-	//  For a complex regex (with no matches) and a large chunk size, this could take a while.
-	// TODO benchmark this. How small of a chunk size can we use without losing performance?
-	std::cout << "Submit: " << pattern << std::endl;
-	std::lock_guard lock(jobs_mtx_);
-	int err;
+bool Finder::search_index(size_t length) {
+	constexpr size_t BLOCK_SIZE = TrigramIndex::BLOCK_SIZE;
+	const TrigramIndex &index = dataset_.trigrams();
+	const size_t start = stream_pos_;
+	const size_t end = std::min(index.end(), length > LOOKAHEAD ? length - LOOKAHEAD : 0);
+	// NOTE: A match that ends in a block can start in the previous one at most, see TrigramIndex::may_match()
+	if (end <= start || max_width_ > std::min<size_t>(MAX_OVERLAP, BLOCK_SIZE)) {
+		return false;
+	}
+	std::vector<const TrigramIndex::Trigrams *> trigrams;
+	for (const Job *job : members_) {
+		if (job) {
+			if (job->trigrams_.empty()) {
+				return false;
+			}
+			trigrams.push_back(&job->trigrams_);
+		}
+	}
 
-	if (jobs_.contains(ctx)) {
-		std::cout << "Erase" << std::endl;
-		jobs_.erase(ctx);
+	// Matches that end in (block * BLOCK_SIZE, (block + 1) * BLOCK_SIZE] belong to the block
+	ZoneScopedN("Finder::search_index()");
+	std::vector<Span> candidates;
+	size_t candidate_size = 0;
+	for (size_t block = start / BLOCK_SIZE; block * BLOCK_SIZE < end; block++) {
+		if (std::none_of(trigrams.begin(), trigrams.end(), [&](auto *t) { return index.may_match(block, *t); })) {
+			continue;
+		}
+		const size_t begin = std::max(start, block * BLOCK_SIZE);
+		const size_t stop = std::min(end, (block + 1) * BLOCK_SIZE);
+		if (!candidates.empty() && candidates.back().end == begin) {
+			candidates.back().end = stop;
+		} else {
+			candidates.push_back({begin, stop});
+		}
+		candidate_size += stop - begin;
+	}
+	// NOTE: Common patterns are faster to search for in ranges of their own, than in bits and pieces
+	if (candidate_size > (end - start) / 2) {
+		return false;
 	}
 
-	if (!jobs_.contains(ctx)) {
-		std::cout << "Create" << std::endl;
-		auto job = Job::create(results_mtx_, dataset_, std::move(on_result), ctx, pattern, flags, err);
-		if (err) {
-			fprintf(stderr, "ERROR: Unable to create job for pattern \"%s\".\n", pattern.data());
-			return err;
+	// Each range gets about the same number of bytes to search, and the last one covers up to the end even if there
+	//  isn't anything left to search
+	const size_t num_ranges = std::max<size_t>(1, std::min(WorkerPool::shared().size(), candidates.size()));
+	std::vector<Range *> ranges;
+	{
+		std::lock_guard lock(ranges_mtx_);
+		size_t begin = start;
+		size_t assigned = 0;
+		auto it = candidates.begin();
+		for (size_t i = 0; i < num_ranges; i++) {
+			const bool last = i + 1 == num_ranges;
+			std::vector<Span> spans;
+			for (; it != candidates.end() && (last || assigned < candidate_size * (i + 1) / num_ranges); it++) {
+				spans.push_back({it->start - std::min<size_t>(it->start, max_width_), it->end + LOOKAHEAD});
+				assigned += it->end - it->start;
+			}
+			if (spans.empty() && !last) {
+				continue;
+			}
+			const size_t range_end = last ? end : spans.back().end - LOOKAHEAD;
+			ranges.push_back(add_range(begin, range_end, std::move(spans)));
+			begin = range_end;
 		}
-		assert(job);
+		next_range_ = 0;
+		ranges_left_ = ranges_.size();
+	}
+	for (Range *range : ranges) {
+		WorkerPool::shared().push(WorkerPool::Priority::kSEARCH, "Finder::scan_range", cancel_, [this, range] { scan_range(*range); });
+	}
+	return true;
+}
 
-		jobs_.emplace(ctx, std::move(job));
+void Finder::scan_range(Range &range) {
+	int err = 0;
+	{
+		auto user = dataset_.user();
+		ZoneScopedN("Finder::scan_range()");
+		if (!range.stream || !range.scratch) {
+			err = -1;
+		} else if (!range.spans.empty() && user.length() < range.spans.back().end) {
+			// The dataset was replaced meanwhile
+			err = 1;
+		}
+		const auto task_start = steady_clock::now();
+		std::optional<ReadAhead> read_ahead;
+		while (err == 0 && range.span < range.spans.size()) {
+			const Span &span = range.spans[range.span];
+			if (range.pos == span.end) {
+				// On to the next span, with a fresh stream
+				if (++range.span < range.spans.size()) {
+					range.pos = range.spans[range.span].start;
+					hs_reset_stream(range.stream, 0, nullptr, nullptr, nullptr);
+					read_ahead.reset();
+				}
+				continue;
+			}
+			if (cancel_.is_cancelled() || changed_) {
+				err = 1;
+				break;
+			}
+			if (steady_clock::now() - task_start >= TASK_TIME) {
+				// Give other work a turn
+				WorkerPool::shared().push(WorkerPool::Priority::kSEARCH, "Finder::scan_range", cancel_, [this, &range] { scan_range(range); });
+				return;
+			}
+			if (!read_ahead) {
+				read_ahead.emplace(user.data(), range.pos, span.end);
+			}
+			const size_t chunk_size = std::min(span.end - range.pos, range.slice);
+			if (!user.data() && range.buffer.size() < chunk_size) {
+				range.buffer.resize_uninitialized(MAX_SLICE);
+			}
+
+			const auto slice_start = steady_clock::now();
+			read_ahead->advance(range.pos);
+			const uint8_t *chunk = user.read(range.pos, chunk_size, range.buffer.data());
+			hs_error_t ret = hs_scan_stream(range.stream, (const char*)chunk, chunk_size, 0, range.scratch, range_event_handler, &range);
+			if (ret == HS_SCAN_TERMINATED) {
+				err = 1;
+				break;
+			}
+			if (ret != HS_SUCCESS) {
+				fprintf(stderr, "ERROR: Unable to scan input buffer\n");
+				err = -2;
+				break;
+			}
+			range.slice = adapt_slice(range.slice, chunk_size, steady_clock::now() - slice_start);
+			range.pos += chunk_size;
+		}
 	}
+	range_done(range, err);
+}
 
-	// Notify the job to start processing the dataset.
-	dataset_.notify();
+void Finder::range_done(Range &range, int err) {
+	std::unique_lock lock(ranges_mtx_);
+	range.done = true;
+	range.err = err;
+
+	// Publish the ranges in order, as soon as they and all before them are done, so that results show up from the top
+	//  while the rest is still being searched
+	for (; next_range_ < ranges_.size() && ranges_[next_range_]->done && ranges_[next_range_]->err == 0; next_range_++) {
+		Range &next = *ranges_[next_range_];
+		for (size_t i = 0; i < members_.size(); i++) {
+			Job *job = members_[i];
+			if (!job || job->stream_pos_ >= next.end) {
+				continue;
+			}
+			job->results_.extend(next.results[i]);
+			job->stream_pos_ = next.end;
+			if (job->on_result_) {
+				job->on_result_(job->ctx_, job->last_report_);
+			}
+			job->last_report_ = job->results_.size();
+		}
+		next.results.clear();
+		stream_pos_ = next.end;
+	}
 
+	if (--ranges_left_ > 0) {
+		return;
+	}
+	bool failed = false;
+	for (auto &done : ranges_) {
+		failed |= done->err < 0;
+		if (done->stream) {
+			hs_close_stream(done->stream, nullptr, nullptr, nullptr);
+		}
+		hs_free_scratch(done->scratch);
+	}
+	ranges_.clear();
+	lock.unlock();
+
+	// NOTE: Interrupted ranges are searched again, by whatever the pass does next
+	if (failed) {
+		fail();
+	}
+	finish();
+}
+
+Finder::Job::Status Finder::Job::status() const {
+	return status_;
+}
+
+
+int Finder::submit(void* ctx, std::function<void(void*, size_t)> &&on_result, std::string_view pattern, int flags) {
+	// NOTE This is called by the main thread on every keystroke in a search box, so it must not block. The pass
+	//  compiles the new set of patterns at its next slice. Compile errors are reported through the job's status().
+	{
+		std::lock_guard lock(jobs_mtx_);
+
+		if (auto it = jobs_.find(ctx); it != jobs_.end()) {
+			retire(std::move(it->second));
+			jobs_.erase(it);
+		}
+
+		auto job = uncache(pattern, flags);
+		if (job) {
+			// NOTE: The pass doesn't refer to cached jobs, and picks this one up through wanted_
+			job->ctx_ = ctx;
+			job->on_result_ = std::move(on_result);
+			job->last_report_ = 0;
+		} else {
+			job = std::unique_ptr<Job>(new Job(std::move(on_result), ctx, pattern, flags, dataset_.rotations()));
+		}
+		{
+			std::lock_guard lock(schedule_mtx_);
+			wanted_.push_back(job.get());
+			changed_ = true;
+		}
+		jobs_.emplace(ctx, std::move(job));
+	}
+	schedule();
 	return 0;
 }
 
 void Finder::remove(void* ctx) {
-	std::lock_guard lock(jobs_mtx_);
-	// TODO This will block until the next match is found. Probably milliseconds, but it's indeterminate.
-	jobs_.erase(ctx);
+	{
+		std::lock_guard lock(jobs_mtx_);
+		if (auto it = jobs_.find(ctx); it != jobs_.end()) {
+			retire(std::move(it->second));
+			jobs_.erase(it);
+		}
+	}
+	schedule();
 }
 
-size_t Finder::find_prev_match(const dynarray<Job::Result> &results, size_t char_idx) {
+size_t Finder::find_prev_match(const MatchIndex &results, size_t char_idx) {
 	// search through results for the first match that starts before char_idx
 	auto it = std::lower_bound(results.begin(), results.end(), char_idx);
 	if (it == results.end()) {
@@ -263,7 +787,7 @@ size_t Finder::find_prev_match(const dynarray<Job::Result> &results, size_t char
 	return it - results.begin();
 }
 
-size_t Finder::find_next_match(const dynarray<Job::Result> &results, size_t char_idx) {
+size_t Finder::find_next_match(const MatchIndex &results, size_t char_idx) {
 	// search through results for the first match that starts after char_idx
 	auto it = std::upper_bound(results.begin(), results.end(), char_idx,
 		[](size_t char_idx, const Job::Result &result) { return char_idx < result.start; });
@@ -273,13 +797,13 @@ size_t Finder::find_next_match(const dynarray<Job::Result> &results, size_t char
 	return it - results.begin();
 }
 
-size_t Finder::find_line_containing_SOM(const dynarray<size_t> &line_starts, const dynarray<Job::Result> &results, size_t match_idx) {
+size_t Finder::find_line_containing_SOM(const LineIndex &line_starts, const MatchIndex &results, size_t match_idx) {
 	auto char_pos = results[match_idx].start;
 
-	auto line_it = std::lower_bound(line_starts.begin(), line_starts.end(), char_pos);
-	assert(line_it != line_starts.end());
-	if (*line_it > char_pos && line_it != line_starts.begin()) {
-		line_it--;
+	auto line_idx = line_starts.lower_bound(char_pos);
+	assert(line_idx != line_starts.size());
+	if (line_starts[line_idx] > char_pos && line_idx != 0) {
+		line_idx--;
 	}
-	return line_it - line_starts.begin();
+	return line_idx;
 }
@@ -1,10 +1,16 @@
 #pragma once
+#include <chrono>
+#include <list>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <string>
 #include <hs/hs_runtime.h>
 
 #include "dataset.h"
 #include "dynarray.h"
+#include "line_index.h"
+#include "match_index.h"
 #include "worker.h"
 
 class Finder {
@@ -14,52 +20,42 @@ public:
 	class Job {
 	public:
 		enum class Status {
+			kCOMPILING,
 			kOK,
-			kQUIT,
 			kERROR,
+			// The pattern doesn't compile
+			kBAD_PATTERN,
 		};
 
-		struct Result {
-			size_t start;
-			size_t end;
-
-			bool operator<(const Result &other) const {
-				return start < other.start;
-			}
-
-			bool operator<(size_t pos) const {
-				return start < pos;
-			}
-		};
+		using Result = MatchIndex::Match;
 
 	private:
-		std::thread thread_;
-		LockableBase(std::mutex) &result_mtx_;
-		Dataset &dataset_;
+		friend class Finder;
+
 		std::function<void(void*, size_t)> on_result_;
 		void *ctx_;
-		const std::string_view pattern_;
+		const std::string pattern_;
 		const int flags_;
-		hs_database_t * const db_;
-		hs_scratch_t * const scratch_;
-		hs_stream_t * const stream_;
-
-		std::atomic_flag quit_ {};
-		size_t stream_pos_ {};
-		std::atomic<Status> status_ {};
-
+		// Dataset::rotations() when the job was created. Its results are stale once that changes.
+		const uint64_t rotations_;
+		// What every match contains, to rule out blocks of the dataset with. Empty if that can't be told.
+		// NOTE: Worked out by the pass when it compiles the pattern, rather than by submit() on the main thread
+		TrigramIndex::Trigrams trigrams_ {};
+		bool has_trigrams_ {};
+
+		// Everything up to here has been searched for this pattern. Matches that end before it were reported by an
+		//  earlier pass, so later ones skip them.
+		std::atomic<size_t> stream_pos_ {};
+		std::atomic<Status> status_ {Status::kCOMPILING};
+
+		// NOTE: Only touched by the pass searching for the pattern
 		dynarray<Result> chunk_results_ {};
-		dynarray<Result> results_ {};
+		// NOTE: Appended to while the main thread reads it, see MatchIndex
+		MatchIndex results_ {};
 		size_t last_report_ {};
 
-		static int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context);
-		int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags);
-		void worker();
-		void quit();
-
 		Job() = delete;
-		Job(LockableBase(std::mutex) &result_mtx, Dataset &dataset, std::function<void(void*, size_t)> &&on_result, void* ctx,
-			std::string_view pattern, int flags, hs_database_t *db, hs_scratch_t *scratch, hs_stream_t *stream);
+		Job(std::function<void(void*, size_t)> &&on_result, void* ctx, std::string_view pattern, int flags, uint64_t rotations);
 		// diable copy and move
 		Job(const Job &) = delete;
 		Job &operator=(const Job &) = delete;
@@ -68,11 +64,11 @@ public:
 		Job &operator=(Job &&) = delete;
 
 	public:
-		~Job();
-		static std::unique_ptr<Job> create(LockableBase(std::mutex) &results_mtx, Dataset &dataset, std::function<void(void*, size_t)> &&on_result,
-			void* ctx, std::string_view pattern, int flags, int &err);
+		~Job() = default;
 
-		const dynarray<Result> &results() const { return results_; }
+		const MatchIndex &results() const { return results_; }
+		// Number of bytes of the dataset searched so far
+		size_t scanned() const { return stream_pos_; }
 		Status status() const;
 	};
 
@@ -80,9 +76,9 @@ public:
 		friend class Finder;
 
 		const Finder &finder_;
-		std::scoped_lock<LockableBase(std::mutex), LockableBase(std::mutex)> lock_;
+		std::scoped_lock<LockableBase(std::mutex)> lock_;
 
-		User(const Finder &finder) : finder_(finder), lock_(finder.jobs_mtx_, finder.results_mtx_) {}
+		User(const Finder &finder) : finder_(finder), lock_(finder.jobs_mtx_) {}
 
 		User() = delete;
 		User(const User &) = delete;
@@ -95,24 +91,154 @@ public:
 		const std::unordered_map<void*, std::unique_ptr<Job>> & jobs() const { return finder_.jobs_; }
 	};
 
+private:
+	// Scans are sliced so that changes to the set of jobs are picked up within about SLICE_TIME, based on the measured
+	//  throughput
+	static constexpr auto SLICE_TIME = std::chrono::milliseconds(1);
+	static constexpr size_t MIN_SLICE = 16ULL * 1024;
+	static constexpr size_t MAX_SLICE = 4ULL * 1024 * 1024;
+	// Each task scans for about this long before requeueing itself, so that other views' work gets a turn
+	static constexpr auto TASK_TIME = std::chrono::milliseconds(16);
+	// Data that's already there when the pass starts is split into ranges that are searched in parallel, if there's
+	//  enough of it and the patterns' matches have a bounded length. The rest is searched as a stream.
+	static constexpr size_t MIN_RANGE_SIZE = 64ULL * 1024 * 1024;
+	// Longest match length that can be split into ranges. Each range starts searching this far before its beginning.
+	static constexpr unsigned int MAX_OVERLAP = 64 * 1024;
+	// Hyperscan's assertions (\b, $ before a newline) look one byte ahead, so ranges are searched a byte past their end
+	static constexpr size_t LOOKAHEAD = 1;
+
+	// Part of a range that's scanned, including the overlap with whatever comes before it
+	struct Span {
+		size_t start;
+		size_t end;
+	};
+
+	struct Range {
+		Finder &finder;
+		// Matches that end in (begin, end] belong to the range
+		size_t begin;
+		size_t end;
+		// Where its stream starts and ends. A single span covers the whole range, unless the trigram index ruled out
+		//  parts of it. The stream starts over at each.
+		std::vector<Span> spans;
+		size_t span {};
+		size_t pos;
+		size_t slice;
+		hs_stream_t *stream {};
+		hs_scratch_t *scratch {};
+		// Matches of each member, until the range is published
+		std::vector<dynarray<Job::Result>> results {};
+		// Only used if the dataset isn't mapped into memory
+		dynarray<uint8_t> buffer {};
+		bool done {};
+		// 0 if the whole range was searched, > 0 if it was interrupted, < 0 on error
+		int err {};
+	};
+
 	Dataset &dataset_;
 
 	mutable TracyLockable(std::mutex, jobs_mtx_);
-	mutable TracyLockable(std::mutex, results_mtx_);
 	std::unordered_map<void*, std::unique_ptr<Job>> jobs_ {};
 
+	// NOTE: All jobs are searched for in a single pass over the dataset, with one database holding every pattern, so
+	//  each byte is read once however many searches are open. The pass is a chain of tasks on the shared WorkerPool
+	//  that run one at a time, as the stream has to be scanned in order. scheduled_ is set while one is queued or
+	//  running.
+	CancelToken cancel_ {};
+	TracyLockable(std::mutex, schedule_mtx_);
+	std::condition_variable_any schedule_cv_ {};
+	bool scheduled_ {};
+	// Set when jobs were added or removed. The pass picks up the new set at its next slice.
+	std::atomic<bool> changed_ {};
+	// Guarded by schedule_mtx_: the jobs to search for, and the replaced ones the pass may still be writing to
+	std::vector<Job *> wanted_ {};
+	std::vector<std::unique_ptr<Job>> retired_ {};
+
+	// Replaced and removed jobs, most recently used first, so that searching for the same again (e.g. after toggling a
+	//  flag back, or undoing a keystroke) carries on where they left off instead of starting over. Results stay valid
+	//  as the dataset grows, but not once it's rotated, as a truncated file's old data reads as zeros.
+	static constexpr size_t CACHE_BUDGET = 256ULL * 1024 * 1024;
+	TracyLockable(std::mutex, cache_mtx_);
+	std::list<std::unique_ptr<Job>> cache_ {};
+	// Memory used by the cached jobs' results
+	size_t cache_size_ {};
+
+	// NOTE: Only touched by the pass. A pattern's ID in the database is its job's index in members_, removed jobs
+	//  leave a nullptr behind until the next recompile.
+	std::vector<Job *> members_ {};
+	hs_database_t *db_ {};
+	hs_scratch_t *scratch_ {};
+	hs_stream_t *stream_ {};
+	// Longest match any of the patterns can have, UINT_MAX if there's no limit
+	unsigned int max_width_ {};
+	size_t slice_ {1ULL * 1024 * 1024};
+	// Only used if the dataset isn't mapped into memory
+	dynarray<uint8_t> buffer_ {};
+	// Where the stream started, and how far the pass got
+	size_t stream_start_ {};
+	std::atomic<size_t> stream_pos_ {};
+
+	// NOTE: Set up by the pass, then only touched with ranges_mtx_ held while its ranges are searched. The last range
+	//  to finish carries on with the pass.
+	TracyLockable(std::mutex, ranges_mtx_);
+	std::vector<std::unique_ptr<Range>> ranges_ {};
+	// The first range that hasn't been published yet
+	size_t next_range_ {};
+	size_t ranges_left_ {};
+
+	static int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context);
+	int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags);
+	static int range_event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context);
+	static size_t adapt_slice(size_t slice, size_t chunk_size, std::chrono::nanoseconds elapsed);
+	// With schedule_mtx_ held
+	bool has_work() const;
+	// Queues a task of the pass if there's anything to do and none is queued or running yet
+	void schedule();
+	void scan();
+	// Called at the end of each task, requeues the pass if there's more to do
+	void finish();
+	// Switches the pass to the current set of jobs. Only recompiles if any were added, removing one just drops it.
+	void update_members();
+	// Offset of from's pattern in job's, if every match of job's contains one of from's there
+	static std::optional<size_t> refinement(const Job &from, const Job &job);
+	// Seeds a new job with the matches of an earlier search that it refines, by checking only those, so that typing
+	//  on in the find box doesn't start over
+	void narrow(Job &job, const std::vector<const Job *> &sources);
+	int compile();
+	int open_stream();
+	void close();
+	// Marks all members as failed and drops them
+	void fail();
+	// With ranges_mtx_ held
+	Range *add_range(size_t begin, size_t end, std::vector<Span> &&spans);
+	void search_ranges(size_t start, size_t end, size_t num_ranges);
+	// Searches only the blocks of the indexed part of the dataset that may contain a match, if that rules out enough.
+	//  Returns false if it doesn't.
+	bool search_index(size_t length);
+	void scan_range(Range &range);
+	// Publishes whatever ranges are done in order, and carries on with the pass once they all are
+	void range_done(Range &range, int err);
+	// With jobs_mtx_ held
+	void retire(std::unique_ptr<Job> &&job);
+	void cache(std::unique_ptr<Job> &&job);
+	// Takes the job for the same search out of the cache, if there is one
+	std::unique_ptr<Job> uncache(std::string_view pattern, int flags);
+
 public:
 	Finder(Dataset &dataset);
 	~Finder();
 
+	// Waits for all jobs to be gone, including retired and cached ones
 	void stop();
 
+	// Never blocks. Replaces the job for ctx, if there is one. Reuses the results of an earlier search for the same
+	//  pattern and flags, if they're still cached.
 	[[nodiscard]] int submit(void* ctx, std::function<void(void*, size_t)> &&on_result, std::string_view pattern, int flags);
 	void remove(void* ctx);
 	User user() const {	return User(*this);	}
 
-	static size_t find_prev_match(const dynarray<Job::Result> &results, size_t char_idx);
-	static size_t find_next_match(const dynarray<Job::Result> &results, size_t char_idx);
-	static size_t find_line_containing_SOM(const dynarray<size_t> &line_starts, const dynarray<Job::Result> &results, size_t match_idx);
+	static size_t find_prev_match(const MatchIndex &results, size_t char_idx);
+	static size_t find_next_match(const MatchIndex &results, size_t char_idx);
+	static size_t find_line_containing_SOM(const LineIndex &line_starts, const MatchIndex &results, size_t match_idx);
 };
 
@@ -0,0 +1,286 @@
+#include "index_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "file.h"
+#include "util.h"
+#include "Tracy.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr char MAGIC[8] = "LVIDX02";
+static constexpr char TRIGRAM_MAGIC[8] = "LVTRI02";
+static constexpr size_t PAGE_SIZE = 4096;
+// Least recently used entries are deleted beyond this size, and entries that haven't been used for MAX_AGE regardless,
+//  e.g. those of files that are long gone
+static constexpr uintmax_t MAX_CACHE_SIZE = 4ULL * 1024 * 1024 * 1024;
+static constexpr auto MAX_AGE = std::chrono::hours(30 * 24);
+
+struct Header {
+	char magic[8];
+	uint64_t file_size;
+	int64_t mtime;
+	uint64_t indexed_size;
+	uint64_t head_hash;
+	uint64_t tail_hash;
+	uint64_t longest_line;
+	// Of everything after the header
+	uint64_t payload_hash;
+};
+
+// FNV-1a
+static uint64_t hash(const uint8_t *data, size_t length) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		h = (h ^ data[i]) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+// FNV-1a over 8-byte words, which is fast enough for the whole payload of an entry. Data can be fed in pieces, as long
+//  as all but the last are a multiple of 8 bytes.
+static uint64_t payload_hash(const uint8_t *data, size_t length, uint64_t h = 0xCBF29CE484222325ULL) {
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+		h = (h ^ word) * 0x100000001B3ULL;
+	}
+	for (; i < length; i++) {
+		h = (h ^ data[i]) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+static uint64_t head_hash(const Source &source, size_t indexed_size) {
+	uint8_t buffer[PAGE_SIZE];
+	const size_t length = std::min(indexed_size, PAGE_SIZE);
+	return hash(source.read(0, length, buffer), length);
+}
+
+static uint64_t tail_hash(const Source &source, size_t indexed_size) {
+	uint8_t buffer[PAGE_SIZE];
+	const size_t start = indexed_size > PAGE_SIZE ? indexed_size - PAGE_SIZE : 0;
+	return hash(source.read(start, indexed_size - start, buffer), indexed_size - start);
+}
+
+static fs::path cache_dir() {
+#ifdef WIN32
+	if (const char *local = getenv("LOCALAPPDATA"); local && *local) {
+		return fs::path(local) / "log_viewer" / "index";
+	}
+#else
+	if (const char *xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+		return fs::path(xdg) / "log_viewer" / "index";
+	}
+	if (const char *home = getenv("HOME"); home && *home) {
+		return fs::path(home) / ".cache" / "log_viewer" / "index";
+	}
+#endif
+	return fs::temp_directory_path() / "log_viewer" / "index";
+}
+
+static fs::path entry_path(const Source &source, const char *extension) {
+	std::error_code ec;
+	auto path = fs::weakly_canonical(fs::absolute(source.path(), ec), ec).string();
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)hash((const uint8_t*)path.data(), path.size()), extension);
+	return cache_dir() / name;
+}
+
+// Deletes entries past MAX_AGE, and then the oldest ones until the rest fit in MAX_CACHE_SIZE. An entry's mtime is the
+//  last time it was used, see read_entry(). keep is never deleted.
+static void prune(const fs::path &keep) {
+	struct Entry {
+		fs::path path;
+		fs::file_time_type time;
+		uintmax_t size;
+	};
+	std::vector<Entry> entries;
+	const auto now = fs::file_time_type::clock::now();
+	std::error_code ec;
+	for (fs::directory_iterator it {cache_dir(), ec}, end; !ec && it != end; it.increment(ec)) {
+		if (!it->is_regular_file(ec) || it->path() == keep) {
+			continue;
+		}
+		Entry entry {it->path(), it->last_write_time(ec), it->file_size(ec)};
+		if (ec) {
+			continue;
+		}
+		if (now - entry.time > MAX_AGE) {
+			fs::remove(entry.path, ec);
+		} else {
+			entries.push_back(std::move(entry));
+		}
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time > b.time; });
+	uintmax_t total = fs::file_size(keep, ec);
+	for (const auto &entry : entries) {
+		total += entry.size;
+		if (total > MAX_CACHE_SIZE) {
+			fs::remove(entry.path, ec);
+		}
+	}
+}
+
+// Maps the entry and hands what follows its header to read, if the header matches the file
+static bool read_entry(const Source &source, const fs::path &path, const char (&magic)[8], Header &header,
+		const std::function<bool(const uint8_t *&data, const uint8_t *end)> &read) {
+	const auto path_string = path.string();
+	File cache {path_string.c_str()};
+	if (cache.open() != 0) {
+		return false;
+	}
+	if (cache.mmap() != 0 || cache.mapped_size() < sizeof(Header)) {
+		cache.close();
+		return false;
+	}
+
+	std::memcpy(&header, cache.mapped_data(), sizeof(header));
+
+	const size_t file_size = source.length();
+	bool valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0
+		&& header.file_size <= file_size
+		&& header.indexed_size <= header.file_size
+		&& (header.file_size != file_size || header.mtime == source.mtime())
+		&& header.head_hash == head_hash(source, header.indexed_size)
+		&& header.tail_hash == tail_hash(source, header.indexed_size);
+
+	if (valid) {
+		// NOTE: Catches entries that were corrupted on disk, or written by a build with a different layout
+		const uint8_t *data = cache.mapped_data() + sizeof(header);
+		const uint8_t *end = cache.mapped_data() + cache.mapped_size();
+		valid = header.payload_hash == payload_hash(data, end - data) && read(data, end);
+	}
+
+	cache.close();
+	std::error_code ec;
+	if (valid) {
+		// Marks the entry as recently used, see prune()
+		fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+	} else {
+		std::cout << "Ignoring stale index cache " << path << "\n";
+	}
+	return valid;
+}
+
+static bool write_entry(const Source &source, const fs::path &path, const char (&magic)[8], size_t indexed_size,
+		size_t longest_line, const std::function<bool(FILE *f)> &write) {
+	const auto tmp_path = fs::path(path).concat(".tmp");
+
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+
+	Header header {
+		{},
+		source.length(),
+		source.mtime(),
+		indexed_size,
+		head_hash(source, indexed_size),
+		tail_hash(source, indexed_size),
+		longest_line,
+		0,
+	};
+	std::memcpy(header.magic, magic, sizeof(magic));
+
+	FILE *f = fopen(tmp_path.string().c_str(), "w+b");
+	if (!f) {
+		std::cerr << "Failed to create index cache " << tmp_path << "\n";
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && write(f);
+
+	// The payload is hashed by reading it back, rather than as it's written, so that write doesn't need to know about it
+	if (ok) {
+		ok = fflush(f) == 0 && fseek(f, sizeof(header), SEEK_SET) == 0;
+		uint64_t h = payload_hash(nullptr, 0);
+		uint8_t buffer[64 * 1024];
+		for (size_t count; ok && (count = fread(buffer, 1, sizeof(buffer), f)) > 0;) {
+			h = payload_hash(buffer, count, h);
+		}
+		header.payload_hash = h;
+		ok = ok && !ferror(f) && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+	}
+	ok &= fclose(f) == 0;
+
+	// Write to a temporary file and rename, so that a crash can't leave a truncated entry behind
+	if (ok) {
+		fs::rename(tmp_path, path, ec);
+		ok = !ec;
+	}
+	if (!ok) {
+		fs::remove(tmp_path, ec);
+		std::cerr << "Failed to write index cache " << path << "\n";
+		return false;
+	}
+	prune(path);
+	return true;
+}
+
+fs::path IndexCache::entry_path(const Source &source) {
+	return ::entry_path(source, ".lvidx");
+}
+
+void IndexCache::disable() {
+	enabled_ = false;
+}
+
+bool IndexCache::load(const Source &source, LineIndex &line_starts, size_t &longest_line) {
+	ZoneScopedN("IndexCache::load");
+	if (!enabled_ || !source.is_cacheable()) {
+		return false;
+	}
+	Header header;
+	return read_entry(source, entry_path(source), MAGIC, header, [&](const uint8_t *&data, const uint8_t *end) {
+		longest_line = header.longest_line;
+		return line_starts.read(data, end) && line_starts.end() == header.indexed_size;
+	});
+}
+
+bool IndexCache::save(const Source &source, const LineIndex &line_starts, size_t longest_line) {
+	ZoneScopedN("IndexCache::save");
+	if (!enabled_ || !source.is_cacheable()) {
+		return false;
+	}
+	Timeit t("Save index");
+	return write_entry(source, entry_path(source), MAGIC, line_starts.end(), longest_line, [&](FILE *f) {
+		return line_starts.write(f);
+	});
+}
+
+bool IndexCache::load_trigrams(const Source &source, TrigramIndex &trigrams) {
+	ZoneScopedN("IndexCache::load_trigrams");
+	if (!enabled_ || !source.is_cacheable()) {
+		return false;
+	}
+	Header header;
+	return read_entry(source, ::entry_path(source, ".lvtri"), TRIGRAM_MAGIC, header, [&](const uint8_t *&data, const uint8_t *end) {
+		// NOTE: The hashes cover the data the last block's trigrams run into as well
+		uint64_t size;
+		if ((size_t)(end - data) < sizeof(size)) {
+			return false;
+		}
+		std::memcpy(&size, data, sizeof(size));
+		return size * TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG == header.indexed_size && trigrams.read(data, end);
+	});
+}
+
+bool IndexCache::save_trigrams(const Source &source, const TrigramIndex &trigrams) {
+	ZoneScopedN("IndexCache::save_trigrams");
+	if (!enabled_ || !source.is_cacheable()) {
+		return false;
+	}
+	Timeit t("Save trigram index");
+	// NOTE: Blocks may be added while it's written, only the ones there at the start are
+	const size_t size = trigrams.size();
+	return write_entry(source, ::entry_path(source, ".lvtri"), TRIGRAM_MAGIC, size * TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG, 0, [&](FILE *f) {
+		return trigrams.write(f, size);
+	});
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <filesystem>
+
+#include "line_index.h"
+#include "source.h"
+#include "trigram_index.h"
+
+// Persists a file's line index between runs, so that reopening a large file only needs to index the data appended since.
+//  The trigram index Finder uses is persisted the same way.
+//
+// Entries live in the user's cache directory, keyed by the file's absolute path, rather than next to the file. Log
+//  directories are often read-only, and a sidecar would be picked up by anything globbing the log directory.
+//
+// An entry is only used if the file is at least as large as the indexed range, the first and last pages of that range
+//  hash the same as when the entry was written, and (if the file hasn't grown) the mtime is unchanged. The entry's own
+//  contents are checked against a hash in its header too.
+//
+// Entries that haven't been used for a month are deleted, as are the least recently used ones once there are more than
+//  a few GB of them.
+class IndexCache {
+	static inline std::atomic<bool> enabled_ {true};
+
+public:
+	// Smaller files are fast enough to index from scratch
+	static constexpr size_t MIN_FILE_SIZE = 64ULL * 1024 * 1024;
+
+	static std::filesystem::path entry_path(const Source &source);
+
+	// Turns load() and save() into no-ops, e.g. so that benchmarks always index the whole file
+	static void disable();
+
+	// Restores the index for source, which must already be updated. Returns false if there is no usable entry.
+	static bool load(const Source &source, LineIndex &line_starts, size_t &longest_line);
+	static bool save(const Source &source, const LineIndex &line_starts, size_t longest_line);
+	// Same for the trigram index, which is kept in an entry of its own as it's built separately. Restores into an empty
+	//  index.
+	static bool load_trigrams(const Source &source, TrigramIndex &trigrams);
+	static bool save_trigrams(const Source &source, const TrigramIndex &trigrams);
+};
@@ -1,16 +1,20 @@
 #include "input_processor.h"
 
 #include <cassert>
+#include <optional>
+#include <vector>
 
+#include "index_cache.h"
 #include "util.h"
-#include <hs/hs.h>
 #include "Tracy.hpp"
 #include "TracyC.h"
 
 using namespace std::chrono;
 
-InputProcessor::InputProcessor(File &&file, Dataset &dataset, std::function<void()> &&on_data)
-	: file_(std::move(file)), dataset_(dataset), on_data_(std::move(on_data)) {
+InputProcessor::InputProcessor(std::unique_ptr<Source> &&source, Dataset &dataset, std::function<void()> &&on_data)
+	: source_(std::move(source)), dataset_(dataset), on_data_(std::move(on_data)) {
+	// The first line always starts at the beginning of the file, even if it's empty
+	line_starts_.push_back(0);
 }
 
 InputProcessor::~InputProcessor() {
@@ -18,68 +22,37 @@ InputProcessor::~InputProcessor() {
 		Timeit t("Loader::~Loader()");
 		quit();
 	}
-
-	if (stream_) hs_close_stream(stream_, nullptr, nullptr, nullptr);
-	if (scratch_) hs_free_scratch(scratch_);
-	if (db_) hs_free_database(db_);
+	// NOTE: Stops the source's own threads before watcher_ goes away, as they may still call interrupt() on it
+	source_.reset();
 }
 
 int InputProcessor::start() {
-	hs_compile_error_t *compile_err;
-	hs_error_t err;
-
-	err = hs_compile_lit("\n", 0, 1, HS_MODE_STREAM, NULL, &db_, &compile_err);
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to compile pattern: %s\n", compile_err->message);
-		hs_free_compile_error(compile_err);
-		return -1;
-	}
-
-	err = hs_alloc_scratch(db_, &scratch_);
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to allocate scratch space. Exiting.\n");
-		return -2;
-	}
-
-	err = hs_open_stream(db_, 0, &stream_);
-	if (err != HS_SUCCESS) {
-		fprintf(stderr, "ERROR: Unable to open stream. Exiting.\n");
-		return -3;
-	}
-
 	thread_ = std::thread(&InputProcessor::worker, this);
 	return 0;
 }
 
 void InputProcessor::stop() {
+	cancel_.cancel();
 	quit_.set();
+	watcher_.interrupt();
 	if (thread_.joinable()) {
 		thread_.join();
 	}
 }
 
-void InputProcessor::get(dynarray<size_t> &line_starts, size_t &longest_line) {
-	// NOTE This is called by the main thread, and will block it during reallocation of line_starts.
-	//  Since this is rare (each time the number of lines doubles), this is acceptable.
-	std::lock_guard lock(mtx_);
-	// Remove previous file end
-	assert(line_starts.size() >= 2);
-	line_starts.resize_uninitialized(line_starts.size() - 1);
-
-	line_starts.extend(line_starts_);
-
-	// Add the new file end
-	size_t last = file_.mapped_size();
-	// if (last) --last;
-
-	line_starts.push_back(last);
-
-	line_starts_.resize_uninitialized(0);
-	longest_line = longest_line_;
+void InputProcessor::request_preview(size_t offset) {
+	std::lock_guard lock(preview_mtx_);
+	if (!previewing_) {
+		return;
+	}
+	preview_target_ = offset;
+	schedule_preview();
 }
 
 void InputProcessor::quit() {
+	cancel_.cancel();
 	quit_.set();
+	watcher_.interrupt();
 	if (thread_.joinable()) {
 		thread_.join();
 	}
@@ -87,103 +60,506 @@ void InputProcessor::quit() {
 
 void InputProcessor::worker() {
 	TracyCSetThreadName("Loader");
+	source_->set_on_available([this] { watcher_.interrupt(); });
+	source_->set_retire([this](std::function<void()> &&free) { dataset_.retire(std::move(free)); });
 	{
 		Timeit timeit("File Open");
-		if (file_.open() != 0) {
-			std::cerr << "Failed to open file_\n";
+		if (source_->open() != 0) {
+			std::cerr << "Failed to open " << source_->path() << "\n";
 			// TODO better error handling
 			return;
 		}
 	}
 
-	while (1) {
-		load_tail();
-		if (quit_.wait(100ms)) {
+	if (source_->is_stream()) {
+		watcher_.watch_interrupts();
+		std::cout << "Streaming " << source_->path() << "\n";
+	} else {
+		watcher_.watch(source_->path());
+		std::cout << (watcher_.is_notifying() ? "Watching " : "Polling ") << source_->path() << "\n";
+	}
+
+	while (!quit_.is_set()) {
+		const bool changed = load_tail();
+		// NOTE: Compressed sources are decoded a batch at a time, so carry on without waiting for the file to change
+		if (!source_->has_more()) {
+			watcher_.wait(changed);
+		}
+	}
+
+	{
+		// NOTE: The indexing task sees cancel_ and stops at its next block
+		std::unique_lock lock(trigrams_mtx_);
+		trigrams_cv_.wait(lock, [this] { return !trigrams_scheduled_; });
+	}
+	save_cache();
+}
+
+bool InputProcessor::publish(const dynarray<size_t> &results, size_t longest_line, size_t end, bool wait) {
+	{
+		ZoneScopedN("extend line starts");
+		std::unique_lock lock(mtx_, std::defer_lock);
+		// The main thread holds the lock for the duration of a frame. Rather than stall on it, keep scanning and
+		//  publish a larger batch next time.
+		if (wait) {
+			lock.lock();
+		} else if (!lock.try_lock()) {
+			return false;
+		}
+		line_starts_.extend(results);
+		line_starts_.set_end(end);
+		longest_line_ = longest_line;
+	}
+	// NOTE: Everything up to end is indexed now, so Finder jobs can search it while the rest of the tail is indexed
+	dataset_.extend(end);
+	if (on_data_) {
+		on_data_();
+	}
+	schedule_trigrams();
+	return true;
+}
+
+void InputProcessor::restore_trigrams() {
+	if (!TrigramIndex::enabled() || source_->length() < TrigramIndex::MIN_DATA_SIZE) {
+		return;
+	}
+	Timeit t("Restore trigram index");
+	// NOTE: No indexing task has been queued yet, so nothing else is writing to the index
+	auto &trigrams = dataset_.trigrams();
+	if (IndexCache::load_trigrams(*source_, trigrams)) {
+		cached_trigrams_ = trigrams.size();
+		std::cout << "Restored trigram index of " << trigrams.end() << " B from cache\n";
+	}
+}
+
+void InputProcessor::schedule_trigrams() {
+	if (!TrigramIndex::enabled() || dataset_.length() < TrigramIndex::MIN_DATA_SIZE) {
+		return;
+	}
+	std::lock_guard lock(trigrams_mtx_);
+	if (trigrams_scheduled_ || cancel_.is_cancelled()) {
+		return;
+	}
+	trigrams_scheduled_ = true;
+	WorkerPool::shared().push(WorkerPool::Priority::kBACKGROUND, "Trigram index", cancel_, [this] { index_trigrams(); });
+}
+
+void InputProcessor::index_trigrams() {
+	auto &trigrams = dataset_.trigrams();
+	// The data a block's trigrams come from
+	constexpr size_t size = TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG;
+	{
+		ZoneScopedN("index trigrams");
+		auto user = dataset_.user();
+		const auto task_start = steady_clock::now();
+		while (!cancel_.is_cancelled() && trigrams.end() + size <= user.length()
+				&& steady_clock::now() - task_start < TRIGRAMS_TASK_TIME) {
+			if (!user.data() && trigrams_buffer_.size() < size) {
+				trigrams_buffer_.resize_uninitialized(size);
+			}
+			trigrams.add(user.read(trigrams.end(), size, trigrams_buffer_.data()));
+		}
+	}
+
+	// Carry on with the rest, or whatever was loaded meanwhile
+	std::lock_guard lock(trigrams_mtx_);
+	if (!cancel_.is_cancelled() && trigrams.end() + size <= dataset_.length()) {
+		WorkerPool::shared().push(WorkerPool::Priority::kBACKGROUND, "Trigram index", cancel_, [this] { index_trigrams(); });
+		return;
+	}
+	trigrams_scheduled_ = false;
+	// NOTE: Notified with the lock held, as the loader may be destroyed as soon as it can take it
+	trigrams_cv_.notify_all();
+}
+
+void InputProcessor::load_sequential(size_t start, size_t end) {
+	const uint8_t *data = source_->data();
+	if (!data && tail_.buffer.size() < CHUNK_SIZE) {
+		tail_.buffer.resize_uninitialized(CHUNK_SIZE);
+	}
+	ReadAhead read_ahead {data, start, end};
+	for (size_t offset = start; offset < end; offset += CHUNK_SIZE) {
+		if (quit_.is_set()) {
+			return;
+		}
+		read_ahead.advance(offset);
+		size_t chunk_size = std::min(end - offset, CHUNK_SIZE);
+		const uint8_t *chunk = source_->read(offset, chunk_size, tail_.buffer.data());
+		NewlineScanner::scan(chunk, chunk_size, offset, tail_.results, tail_.state);
+
+		if (publish(tail_.results, tail_.state.longest_line, offset + chunk_size, offset + chunk_size == end)) {
+			tail_.results.resize_uninitialized(0);
+		}
+	}
+}
+
+int InputProcessor::scan_segment(Segment &segment, size_t start, size_t end) {
+	ZoneScopedN("scan segment");
+
+	// NOTE: The kernel's readahead only follows one or two streams per file, so each segment prefetches its own
+	const uint8_t *data = source_->data();
+	if (!data) {
+		segment.buffer.resize_uninitialized(CHUNK_SIZE);
+	}
+	ReadAhead read_ahead {data, start, end};
+	for (size_t offset = start; offset < end; offset += CHUNK_SIZE) {
+		if (cancel_.is_cancelled()) {
+			return 1;
+		}
+		read_ahead.advance(offset);
+		size_t chunk_size = std::min(end - offset, CHUNK_SIZE);
+		const uint8_t *chunk = source_->read(offset, chunk_size, segment.buffer.data());
+		NewlineScanner::scan(chunk, chunk_size, offset, segment.results, segment.state);
+	}
+	return 0;
+}
+
+void InputProcessor::load_parallel(size_t start, size_t end, size_t num_segments) {
+	ZoneScopedN("parallel load");
+	// Round segment sizes up to whole chunks
+	const size_t segment_size = ((end - start) / num_segments + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+
+	std::vector<Segment> segments (num_segments);
+	std::vector<int> errors (num_segments);
+	std::vector<Event> done (num_segments);
+	size_t count = 1;
+
+	for (size_t i = 1; i < num_segments; i++) {
+		const size_t segment_start = start + i * segment_size;
+		if (segment_start >= end) {
 			break;
 		}
+		const size_t segment_end = std::min(end, segment_start + segment_size);
+		segments[i].state.prev_start = segment_start;
+		WorkerPool::shared().push(WorkerPool::Priority::kBACKGROUND, "Loader segment", cancel_,
+			[this, &segments, &errors, &done, i, segment_start, segment_end] {
+				errors[i] = scan_segment(segments[i], segment_start, segment_end);
+				done[i].set();
+			});
+		count++;
+	}
+	// NOTE: The first segment carries on from the previous load, so it can publish as it goes, and Finder can start
+	//  searching before the other segments are done
+	load_sequential(start, std::min(end, start + segment_size));
+
+	// Stitch the segments together in order. Each one is published as soon as it and all previous segments are done,
+	//  so the top of the file becomes visible while the rest is still being indexed.
+	bool ok = true;
+	for (size_t i = 1; i < count; i++) {
+		// NOTE: Always waits for every segment, even when quitting, as the tasks refer to this frame
+		done[i].wait();
+		auto &segment = segments[i];
+
+		if (errors[i] != 0) {
+			if (errors[i] < 0) {
+				std::cerr << "Failed to index segment " << i << ": " << errors[i] << "\n";
+			}
+			ok = false;
+		}
+		if (!ok) {
+			continue;
+		}
+
+		// The first line of this segment started in a previous one, so the segment's own longest_line may be too short.
+		auto &state = segment.state;
+		if (!segment.results.empty()) {
+			state.longest_line = std::max(state.longest_line, segment.results.front() - tail_.state.prev_start);
+			tail_.state.prev_start = segment.results.back();
+		}
+		tail_.state.longest_line = std::max(tail_.state.longest_line, state.longest_line);
+
+		publish(segment.results, tail_.state.longest_line, std::min(end, start + (i + 1) * segment_size), true);
+		segment.results = {};
 	}
 }
 
-int InputProcessor::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
-	return static_cast<InputProcessor *>(context)->event_handler(id, from, to, flags);
+void InputProcessor::start_preview() {
+	std::lock_guard lock(preview_mtx_);
+	previewing_ = true;
+	preview_target_ = Preview::TAIL;
+	preview_scanned_.reset();
+	schedule_preview();
 }
 
-int InputProcessor::event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags) {
-	// This is faster and uses less memory than enabling the HS_FLAG_SOM_LEFTMOST flag
-	// from = to - 1;
-	// chunk_results_.push_back(from);
+void InputProcessor::stop_preview() {
+	{
+		std::unique_lock lock(preview_mtx_);
+		previewing_ = false;
+		preview_cv_.wait(lock, [this] { return !preview_scheduled_; });
+	}
+	{
+		std::lock_guard lock(mtx_);
+		preview_.reset();
+	}
+	if (on_data_) {
+		on_data_();
+	}
+}
+
+void InputProcessor::schedule_preview() {
+	if (preview_scheduled_) {
+		// NOTE: The task picks up the new target when it's done with the current one
+		return;
+	}
+	preview_scheduled_ = true;
+	WorkerPool::shared().push(WorkerPool::Priority::kVISIBLE, "Preview", cancel_, [this] { previewer(); });
+}
+
+void InputProcessor::previewer() {
+	std::unique_lock lock(preview_mtx_);
+	while (previewing_ && preview_scanned_ != preview_target_) {
+		const size_t target = preview_target_;
+		lock.unlock();
+
+		auto preview = std::make_shared<Preview>();
+		if (int ret = scan_preview(target, *preview); ret == 0) {
+			{
+				std::lock_guard data_lock(mtx_);
+				preview_ = std::move(preview);
+			}
+			if (on_data_) {
+				on_data_();
+			}
+		} else if (ret < 0) {
+			std::cerr << "Failed to preview " << source_->path() << " at " << target << ": " << ret << "\n";
+		}
+		lock.lock();
+		preview_scanned_ = target;
+	}
+	preview_scheduled_ = false;
+	preview_cv_.notify_all();
+}
+
+int InputProcessor::scan_preview(size_t target, Preview &preview) {
+	ZoneScopedN("scan preview");
+	Timeit timeit("Preview");
+	auto user = dataset_.user();
+	const size_t length = user.readable_length();
+	if (length == 0) {
+		return 1;
+	}
+	const size_t begin = target >= length
+		? length - std::min(length, PREVIEW_SIZE)
+		: std::min(target - std::min(target, PREVIEW_SIZE / 2), length - std::min(length, PREVIEW_SIZE));
+	const size_t end = std::min(length, begin + PREVIEW_SIZE);
+
+	dynarray<uint8_t> buffer {};
+	if (!user.data()) {
+		buffer.resize_uninitialized(CHUNK_SIZE);
+	}
+	dynarray<size_t> results {};
+	NewlineScanner::State state {begin};
+	for (size_t offset = begin; offset < end; offset += CHUNK_SIZE) {
+		if (cancel_.is_cancelled()) {
+			return 1;
+		}
+		const size_t chunk_size = std::min(end - offset, CHUNK_SIZE);
+		const uint8_t *chunk = user.peek(offset, chunk_size, buffer.data());
+		NewlineScanner::scan(chunk, chunk_size, offset, results, state);
+	}
 
-	// We actually want to record with position _after_ the newline character.
-	chunk_results_.push_back(to);
-	size_t line_len = to - prev_start_;
-	prev_start_ = to;
-	unsafe_longest_line_ = std::max(unsafe_longest_line_, line_len);
-	return 0; // Continue matching
+	// NOTE: The window usually starts and ends in the middle of a line. Only whole lines are kept, except for the last
+	//  one in the file, which the index also includes without a newline.
+	const bool at_end = end == length;
+	size_t last = results.size();
+	if (begin == 0) {
+		preview.line_starts.push_back(0);
+	}
+	if (!at_end) {
+		if (last == 0) {
+			// Not a single whole line in the window
+			return 2;
+		}
+		last--;
+	}
+	for (size_t i = 0; i < last; i++) {
+		preview.line_starts.push_back(results[i]);
+	}
+	if (preview.line_starts.size() == 1) {
+		return 2;
+	}
+	preview.line_starts.set_end(at_end ? end : results[last]);
+	for (size_t i = 0; i + 1 < preview.line_starts.size(); i++) {
+		preview.longest_line = std::max(preview.longest_line, preview.line_starts[i + 1] - preview.line_starts[i]);
+	}
+	preview.target = target;
+	return 0;
 }
 
-void InputProcessor::load_tail() {
-	static constexpr size_t CHUNK_SIZE = 1ULL * 1024 * 1024;
+size_t InputProcessor::User::estimate_line(size_t offset) const {
+	const auto &line_starts = loader_.line_starts_;
+	const size_t num_lines = line_starts.size() - 1;
+	if (offset <= line_starts.end()) {
+		const size_t idx = line_starts.lower_bound(offset);
+		return idx == 0 || line_starts[idx] == offset ? idx : idx - 1;
+	}
 
-	const auto prev_size = file_.mapped_size();
+	size_t lines = num_lines;
+	size_t bytes = line_starts.end();
+	if (const auto &preview = loader_.preview_) {
+		lines += preview->line_starts.size() - 1;
+		bytes += preview->line_starts.end() - preview->line_starts[0];
+	}
+	if (lines == 0) {
+		return 0;
+	}
+	return num_lines + (size_t)((double)(offset - line_starts.end()) * lines / bytes);
+}
 
-	if (file_.size() <= prev_size) {
+bool InputProcessor::load_tail() {
+	const auto prev_size = source_->length();
+	const auto size = source_->available();
+	// NOTE: A truncated file looks like it has nothing new, but has to be dealt with right away
+	const bool rotated = prev_size != 0 && source_->rotated();
+
+	if (size <= prev_size && !rotated) {
 		// No new data to load
-		return;
+		return false;
 	}
 
 	ZoneScopedN("load tail");
-	{
+	// NOTE: The first update always publishes a new snapshot, which is what hands the source to the dataset
+	if (prev_size != 0 && !rotated && source_->can_update_in_place(size)) {
+		// NOTE: The data doesn't move, so the current snapshot stays valid and is only extended as lines are indexed
+		ZoneScopedN("extend source");
+		if (source_->update(size) != 0) {
+			std::cerr << "Failed to update " << source_->path() << "\n";
+			// TODO better error handling
+			return false;
+		}
+	} else {
 		ZoneScopedN("remap");
-		auto updater = dataset_.updater();
-
+		// NOTE: Users of the dataset carry on with their snapshot meanwhile. Whatever the update moves away from is
+		//  retired through the dataset, and only freed once they're done with it.
 		// Timeit timeit("File remap");
-		if (file_.mmap() != 0) {
-			std::cerr << "Failed to map file_\n";
+		if (source_->update(size) != 0) {
+			std::cerr << "Failed to update " << source_->path() << "\n";
 			// TODO better error handling
-			return;
+			return false;
 		}
 		// timeit.stop();
-		// std::cout << "File remapped: " << prev_size << " B -> " << file_.mapped_size() << " B\n";
+		// std::cout << "File remapped: " << prev_size << " B -> " << source_->length() << " B\n";
 
 		// NOTE Purposely keep the previous size, so that other users of the dataset (e.g. Finder) do not emit results
 		//  greater than the last line in line_starts_, as this would be confusing to deal with
-		updater.set(file_.mapped_data(), prev_size);
+		dataset_.set(source_.get(), prev_size, source_->length());
+	}
+
+	if (rotated) {
+		dataset_.rotate();
+		// The watch followed the old file
+		watcher_.watch(source_->path());
 	}
 
-	const auto new_size = file_.mapped_size();
+	const auto new_size = source_->length();
+	if (new_size == prev_size) {
+		return false;
+	}
+	// On first load, pick up where a previous run left off if possible
+	const auto start = prev_size == 0 ? restore_cache() : prev_size;
+	if (prev_size == 0) {
+		restore_trigrams();
+	}
+	bool preview = false;
 	{
 		ZoneScopedN("find new lines");
-		size_t total_size = new_size - prev_size;
-		std::cout << "Loading " << total_size << " B\n";
+		// NOTE: The first load reads the whole file front to back, but afterwards most reads come from the user jumping
+		//  around in it
+		if (prev_size == 0) {
+			source_->advise(File::Access::kSEQUENTIAL);
+		}
+		size_t total_size = new_size - start;
+		// NOTE: Nothing past the indexed part of the file can be shown, so on a large file, index a window around the
+		//  point of interest first. Sources that are still decoding don't have their tail yet.
+		preview = prev_size == 0 && total_size >= PREVIEW_MIN_SIZE && !source_->has_more();
+		if (preview) {
+			start_preview();
+		}
+		const size_t num_segments = std::min<size_t>(WorkerPool::shared().size(), total_size / MIN_SEGMENT_SIZE);
 		Timeit load_timeit("Load");
 
-		chunk_results_.resize_uninitialized(0);
-
-		for (size_t offset = 0; offset < total_size; offset += CHUNK_SIZE) {
-			size_t chunk_size = std::min(total_size - offset, CHUNK_SIZE);
-			hs_error_t err = hs_scan_stream(stream_, (const char*)file_.mapped_data() + prev_size + offset, chunk_size, 0,
-				scratch_, event_handler, this);
-
-			assert(err == HS_SUCCESS);
-
-			{
-				ZoneScopedN("extend line starts");
-				std::unique_lock lock(mtx_);
-				line_starts_.extend(lock, chunk_results_);
-				longest_line_ = unsafe_longest_line_;
-			}
-			if (on_data_) {
-				on_data_();
-			}
-			chunk_results_.resize_uninitialized(0);
+		if (num_segments > 1) {
+			load_parallel(start, new_size, num_segments);
+		} else {
+			load_sequential(start, new_size);
 		}
 		load_timeit.stop();
+		if (prev_size == 0) {
+			source_->advise(File::Access::kNORMAL);
+		}
+	}
+	if (quit_.is_set()) {
+		if (preview) {
+			stop_preview();
+		}
+		return true;
 	}
 
 	{
 		ZoneScopedN("update dataset");
-		auto updater = dataset_.updater();
-		// NOTE: Now that line_starts_ has been updated, we can allow other users to access the new data.
-		updater.set(file_.mapped_data(), file_.mapped_size());
+		// NOTE: Each indexed chunk has already been published. This only matters if nothing needed indexing, e.g. when
+		//  the whole file was restored from the cache.
+		dataset_.extend(new_size);
+	}
+	schedule_trigrams();
+	if (preview) {
+		// The exact index covers the preview now
+		stop_preview();
+	}
+
+	// NOTE: Writing the index costs as much as the index is large, so while the file grows it's only rewritten once it
+	//  has doubled since. The loader writes the rest when it stops.
+	if (new_size >= 2 * cached_size_) {
+		save_cache();
+	}
+	return true;
+}
+
+size_t InputProcessor::restore_cache() {
+	if (source_->length() < IndexCache::MIN_FILE_SIZE) {
+		return 0;
+	}
+
+	Timeit t("Restore index");
+	LineIndex line_starts {};
+	size_t longest_line {};
+	if (!IndexCache::load(*source_, line_starts, longest_line)) {
+		return 0;
+	}
+
+	const size_t indexed_size = line_starts.end();
+	tail_.state.prev_start = line_starts[line_starts.size() - 2];
+	tail_.state.longest_line = longest_line;
+	{
+		std::lock_guard lock(mtx_);
+		line_starts_ = std::move(line_starts);
+		longest_line_ = longest_line;
+	}
+	cached_size_ = indexed_size;
+	std::cout << "Restored index of " << indexed_size << " B from cache\n";
+	// Finder can search the restored part while the rest is indexed
+	dataset_.extend(indexed_size);
+
+	if (on_data_) {
+		on_data_();
+	}
+	return indexed_size;
+}
+
+void InputProcessor::save_cache() {
+	// NOTE: The index is written as far as it got, while it's built further. It's only rewritten once it has doubled,
+	//  as it's a lot larger than the line index.
+	const auto &trigrams = dataset_.trigrams();
+	if (trigrams.end() >= TrigramIndex::MIN_DATA_SIZE && trigrams.size() >= 2 * cached_trigrams_
+			&& IndexCache::save_trigrams(*source_, trigrams)) {
+		cached_trigrams_ = trigrams.size();
+	}
+
+	// NOTE: This thread is the only writer of line_starts_, so it can be read without the lock
+	if (line_starts_.end() < IndexCache::MIN_FILE_SIZE || line_starts_.end() == cached_size_) {
+		return;
+	}
+	if (IndexCache::save(*source_, line_starts_, tail_.state.longest_line)) {
+		cached_size_ = line_starts_.end();
 	}
 }
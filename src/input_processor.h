@@ -1,38 +1,138 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <thread>
-#include <hs/hs.h>
 
 #include "dataset.h"
 #include "dynarray.h"
-#include "file.h"
+#include "file_watcher.h"
+#include "line_index.h"
+#include "newline_scanner.h"
+#include "source.h"
 #include "worker.h"
 
 class InputProcessor {
-	File file_;
+public:
+	// A window of lines around a point of interest (the tail by default), indexed ahead of the rest of a large file so
+	//  that it can be shown right away. The line starts are exact, but the line numbers are only estimates until
+	//  everything before the window has been indexed. Published previews are immutable, a new target replaces them.
+	struct Preview {
+		static constexpr size_t TAIL = SIZE_MAX;
+
+		// Offset the window was requested for, usually inside it
+		size_t target {};
+		LineIndex line_starts {};
+		size_t longest_line {};
+	};
+
+	class User {
+		friend class InputProcessor;
+
+		const InputProcessor &loader_;
+		std::unique_lock<LockableBase(std::mutex)> lock_;
+
+		User(const InputProcessor &loader) : loader_(loader), lock_(loader.mtx_) {}
+
+		User() = delete;
+		User(const User &) = delete;
+		User &operator=(const User &) = delete;
+		User(User &&) = delete;
+		User &operator=(User &&) = delete;
+
+	public:
+		~User() = default;
+		const LineIndex &line_starts() const { return loader_.line_starts_; }
+		size_t longest_line() const { return loader_.longest_line_; }
+		// nullptr unless the initial load of a large file is in progress
+		std::shared_ptr<const Preview> preview() const { return loader_.preview_; }
+		// Line number of offset. Exact if it has been indexed, otherwise extrapolated from the average line length.
+		size_t estimate_line(size_t offset) const;
+	};
+
+private:
+	static constexpr size_t CHUNK_SIZE = 1ULL * 1024 * 1024;
+	// Ranges smaller than this are not worth splitting into parallel tasks
+	static constexpr size_t MIN_SEGMENT_SIZE = 16ULL * 1024 * 1024;
+	// Each trigram indexing task runs for about this long before requeueing itself
+	static constexpr auto TRIGRAMS_TASK_TIME = std::chrono::milliseconds(16);
+	// Initial loads smaller than this are quick enough to wait for
+	static constexpr size_t PREVIEW_MIN_SIZE = 256ULL * 1024 * 1024;
+	// Comfortably more than a screen's worth of buffered lines (MAX_VISIBLE_CHARS) for typical line lengths
+	static constexpr size_t PREVIEW_SIZE = 4ULL * 1024 * 1024;
+
+	// A contiguous range of the file scanned by one task. The initial load is split into several of these so that
+	//  they can be indexed in parallel, and then stitched together in order.
+	struct Segment {
+		NewlineScanner::State state {};
+		dynarray<size_t> results {};
+		// Only used for sources that aren't contiguous in memory
+		dynarray<uint8_t> buffer {};
+	};
+
+	std::unique_ptr<Source> source_;
 	Dataset &dataset_;
 	std::function<void()> on_data_;
-	hs_database_t * db_ {};
-	hs_scratch_t * scratch_ {};
-	hs_stream_t * stream_ {};
-	TracyLockable(std::mutex, mtx_);
-	size_t prev_start_ {};
-	dynarray<size_t> chunk_results_ {};
-	dynarray<size_t> line_starts_ {};
+	mutable TracyLockable(std::mutex, mtx_);
+	// Sequential scan state, used for data appended after the initial (possibly parallel) load
+	Segment tail_ {};
+	LineIndex line_starts_ {};
+	// Number of bytes covered by the persisted index
+	size_t cached_size_ {};
 	// NOTE: This length includes the newline character. It's only used for scroll bar size calculations, so fine for now.
-	size_t unsafe_longest_line_ {};
 	size_t longest_line_ {};
 	std::thread thread_ {};
 	Event quit_ {};
+	// Cancels the loader's tasks on the shared WorkerPool
+	CancelToken cancel_ {};
+	FileWatcher watcher_ {quit_};
+
+	// NOTE: Only set during the initial load, guarded by mtx_
+	std::shared_ptr<const Preview> preview_ {};
+	TracyLockable(std::mutex, preview_mtx_);
+	std::condition_variable_any preview_cv_ {};
+	// Guarded by preview_mtx_
+	size_t preview_target_ {Preview::TAIL};
+	std::optional<size_t> preview_scanned_ {};
+	bool previewing_ {};
+	// Set while a preview task is queued or running
+	bool preview_scheduled_ {};
+
+	// NOTE: The dataset's trigram index is built by a chain of background tasks, a block at a time, once the dataset is
+	//  large enough for it to pay off
+	TracyLockable(std::mutex, trigrams_mtx_);
+	std::condition_variable_any trigrams_cv_ {};
+	// Guarded by trigrams_mtx_. Set while an indexing task is queued or running.
+	bool trigrams_scheduled_ {};
+	// Only used for sources that aren't contiguous in memory
+	dynarray<uint8_t> trigrams_buffer_ {};
+	// Number of blocks covered by the persisted trigram index
+	size_t cached_trigrams_ {};
 
 	void quit();
 	void worker();
-	void load_tail();
-
-	static int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context);
-	int event_handler(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags);
+	// Returns true if any new data was loaded
+	bool load_tail();
+	size_t restore_cache();
+	void save_cache();
+	void load_sequential(size_t start, size_t end);
+	void load_parallel(size_t start, size_t end, size_t num_segments);
+	int scan_segment(Segment &segment, size_t start, size_t end);
+	bool publish(const dynarray<size_t> &results, size_t longest_line, size_t end, bool wait);
+	void start_preview();
+	void stop_preview();
+	// With preview_mtx_ held
+	void schedule_preview();
+	void previewer();
+	int scan_preview(size_t target, Preview &preview);
+	void restore_trigrams();
+	// Queues a trigram indexing task if there's a block to index and none is queued or running yet
+	void schedule_trigrams();
+	void index_trigrams();
 
 	InputProcessor() = delete;
 	// diable copy and move
@@ -43,11 +143,14 @@ class InputProcessor {
 	InputProcessor &operator=(InputProcessor &&) = delete;
 
 public:
-	InputProcessor(File &&file, Dataset &dataset, std::function<void()> &&on_data);
+	InputProcessor(std::unique_ptr<Source> &&source, Dataset &dataset, std::function<void()> &&on_data);
 	~InputProcessor();
 
 	int start();
 	void stop();
+	// Indexes the lines around offset ahead of the rest of the file, if the initial load is still in progress
+	void request_preview(size_t offset);
 
-	void get(dynarray<size_t> &line_starts, size_t &longest_line);
+	// NOTE: The loader can't publish new lines while this is held
+	User user() const {	return User(*this);	}
 };
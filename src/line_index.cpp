@@ -0,0 +1,103 @@
+#include "line_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+size_t LineIndex::lower_bound(size_t value) const {
+	// The first block whose base is >= value bounds the search to the end of the previous block
+	auto it = std::lower_bound(blocks_.begin(), blocks_.end(), value,
+		[](const Block &block, size_t v) { return block.base < v; });
+	const size_t block_idx = it - blocks_.begin();
+
+	size_t lo = block_idx ? (block_idx - 1) * BLOCK_SIZE : 0;
+	size_t hi = std::min(size_, block_idx * BLOCK_SIZE);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (at(mid) < value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < size_) {
+		return lo;
+	}
+	return end_ >= value ? size_ : size_ + 1;
+}
+
+size_t LineIndex::memory_usage() const {
+	return blocks_.memory_usage() + deltas16_.memory_usage() + deltas32_.memory_usage() + deltas64_.memory_usage();
+}
+
+template<typename T>
+static bool write_array(FILE *f, const segarray<T> &array) {
+	const uint64_t size = array.size();
+	bool ok = fwrite(&size, sizeof(size), 1, f) == 1;
+	array.for_each_segment([&](const T *data, size_t count) {
+		ok = ok && fwrite(data, sizeof(T), count, f) == count;
+	});
+	return ok;
+}
+
+template<typename T>
+static bool read_array(const uint8_t *&data, const uint8_t *end, segarray<T> &array) {
+	uint64_t size;
+	if ((size_t)(end - data) < sizeof(size)) {
+		return false;
+	}
+	std::memcpy(&size, data, sizeof(size));
+	data += sizeof(size);
+
+	if ((size_t)(end - data) / sizeof(T) < size) {
+		return false;
+	}
+	// NOTE: The data isn't necessarily aligned for T, extend() copies it bytewise
+	array.resize_uninitialized(0);
+	array.extend(reinterpret_cast<const T *>(data), size);
+	data += size * sizeof(T);
+	return true;
+}
+
+bool LineIndex::write(FILE *f) const {
+	const uint64_t header[] {size_, end_};
+	return fwrite(header, sizeof(header), 1, f) == 1
+		&& write_array(f, blocks_)
+		&& write_array(f, deltas16_)
+		&& write_array(f, deltas32_)
+		&& write_array(f, deltas64_);
+}
+
+bool LineIndex::read(const uint8_t *&data, const uint8_t *end) {
+	uint64_t header[2];
+	if ((size_t)(end - data) < sizeof(header)) {
+		return false;
+	}
+	std::memcpy(header, data, sizeof(header));
+	data += sizeof(header);
+
+	if (!read_array(data, end, blocks_) || !read_array(data, end, deltas16_) || !read_array(data, end, deltas32_)
+		|| !read_array(data, end, deltas64_)) {
+		return false;
+	}
+	size_ = header[0];
+	end_ = header[1];
+	// Sanity check that the arrays are consistent with the number of entries, and that every block's deltas are in
+	//  its pool, as at() doesn't check
+	if (blocks_.size() != (size_ + BLOCK_MASK) / BLOCK_SIZE) {
+		return false;
+	}
+	for (const Block &block : blocks_) {
+		size_t pool_size;
+		switch (block.width) {
+			case Width::k16: pool_size = deltas16_.size(); break;
+			case Width::k32: pool_size = deltas32_.size(); break;
+			case Width::k64: pool_size = deltas64_.size(); break;
+			default:         return false;
+		}
+		if (pool_size / BLOCK_SIZE <= block.slot) {
+			return false;
+		}
+	}
+	return true;
+}
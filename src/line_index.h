@@ -0,0 +1,145 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+
+#include "dynarray.h"
+#include "segarray.h"
+
+// Compressed array of line start offsets, followed by the end of the indexed data.
+//
+// Entries are grouped into fixed size blocks, each of which stores an absolute base offset and per-entry deltas from
+//  that base. Blocks start out with 16-bit deltas, and are promoted to 32 or 64-bit deltas only if the block spans more
+//  bytes than that, so typical logs cost a little over 2 bytes per line instead of 8. Because blocks have a fixed number
+//  of entries, random access is still O(1).
+//
+// NOTE: size() includes the end entry, so line i spans [at(i), at(i + 1)) for all i < size() - 1.
+class LineIndex {
+	static constexpr size_t BLOCK_SHIFT = 8;
+	static constexpr size_t BLOCK_SIZE = 1ULL << BLOCK_SHIFT;
+	static constexpr size_t BLOCK_MASK = BLOCK_SIZE - 1;
+
+	enum class Width : uint8_t {
+		k16,
+		k32,
+		k64,
+	};
+
+	struct Block {
+		size_t base;
+		// Index of this block's deltas in the pool for its width, in units of BLOCK_SIZE entries
+		uint32_t slot;
+		Width width;
+	};
+
+	// NOTE: None of these move as they grow, so appending never copies the index
+	segarray<Block> blocks_ {};
+	segarray<uint16_t> deltas16_ {};
+	segarray<uint32_t> deltas32_ {};
+	segarray<uint64_t> deltas64_ {};
+	// Number of line starts, not including the end entry
+	size_t size_ {};
+	size_t end_ {};
+
+	// diable copy
+	LineIndex(const LineIndex &) = delete;
+	LineIndex &operator=(const LineIndex &) = delete;
+
+	template<typename From, typename To>
+	static void promote(const segarray<From> &from, segarray<To> &to, Block &block, size_t count) {
+		const size_t slot = to.size() / BLOCK_SIZE;
+		to.resize_uninitialized(to.size() + BLOCK_SIZE);
+		for (size_t i = 0; i < count; i++) {
+			to[slot * BLOCK_SIZE + i] = from[block.slot * BLOCK_SIZE + i];
+		}
+		block.slot = slot;
+	}
+
+	void open_block(size_t value) {
+		const size_t slot = deltas16_.size() / BLOCK_SIZE;
+		deltas16_.resize_uninitialized(deltas16_.size() + BLOCK_SIZE);
+		blocks_.push_back(Block {value, (uint32_t)slot, Width::k16});
+	}
+
+	void widen(Block &block, size_t delta) {
+		const size_t count = size_ & BLOCK_MASK;
+
+		if (block.width == Width::k16) {
+			// The open block is always the last one in its pool, so its old slot can be reclaimed
+			promote(deltas16_, deltas32_, block, count);
+			block.width = Width::k32;
+			deltas16_.resize_uninitialized(deltas16_.size() - BLOCK_SIZE);
+		}
+		if (block.width == Width::k32 && delta > UINT32_MAX) {
+			promote(deltas32_, deltas64_, block, count);
+			block.width = Width::k64;
+			deltas32_.resize_uninitialized(deltas32_.size() - BLOCK_SIZE);
+		}
+	}
+
+public:
+	LineIndex() = default;
+	LineIndex(LineIndex &&) noexcept = default;
+	LineIndex &operator=(LineIndex &&) noexcept = default;
+
+	size_t size() const { return size_ + 1; }
+	size_t end() const { return end_; }
+
+	size_t operator[](size_t index) const { return at(index); }
+	size_t at(size_t index) const {
+		assert(index <= size_);
+		if (index == size_) {
+			return end_;
+		}
+		const Block &block = blocks_[index >> BLOCK_SHIFT];
+		const size_t pos = (size_t)block.slot * BLOCK_SIZE + (index & BLOCK_MASK);
+		switch (block.width) {
+			case Width::k16: return block.base + deltas16_[pos];
+			case Width::k32: return block.base + deltas32_[pos];
+			default:         return block.base + deltas64_[pos];
+		}
+	}
+
+	// Index of the first entry >= value, or size() if there is none
+	size_t lower_bound(size_t value) const;
+
+	// Approximate heap usage, in bytes
+	size_t memory_usage() const;
+
+	// Raw (native endian and layout) serialization, used to persist the index between runs
+	bool write(FILE *f) const;
+	// Advances data past the serialized index on success
+	bool read(const uint8_t *&data, const uint8_t *end);
+
+	void set_end(size_t end) {
+		end_ = end;
+	}
+
+	void push_back(size_t value) {
+		assert(size_ == 0 || value >= at(size_ - 1));
+
+		if ((size_ & BLOCK_MASK) == 0) {
+			open_block(value);
+		}
+
+		Block &block = blocks_.back();
+		const size_t delta = value - block.base;
+		if ((block.width == Width::k16 && delta > UINT16_MAX) || (block.width == Width::k32 && delta > UINT32_MAX)) {
+			widen(block, delta);
+		}
+
+		const size_t pos = (size_t)block.slot * BLOCK_SIZE + (size_ & BLOCK_MASK);
+		switch (block.width) {
+			case Width::k16: deltas16_[pos] = delta; break;
+			case Width::k32: deltas32_[pos] = delta; break;
+			default:         deltas64_[pos] = delta; break;
+		}
+		size_++;
+	}
+
+	void extend(const dynarray<size_t> &values) {
+		for (const auto value : values) {
+			push_back(value);
+		}
+	}
+};
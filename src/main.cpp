@@ -1,4 +1,7 @@
+#include <cstring>
+
 #include "app_window.h"
+#include "benchmark.h"
 
 
 void write_file(FILE *h) {
@@ -34,6 +37,9 @@ void write_file(FILE *h) {
 
 int main(int argc, char *argv[]) {
     int err {};
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        return Benchmark::main(argc, argv);
+    }
     setvbuf(stdout, nullptr, _IOFBF, 1024 * 1024);
 
     auto h = fopen("C:/development/log_viewer_win/test_set/tailer.log", "wb");
@@ -0,0 +1,247 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+
+#include "dynarray.h"
+#include "segarray.h"
+
+// Compressed array of matches, with a single writer and any number of concurrent readers (see segarray).
+//
+// Like LineIndex, the starts are grouped into fixed size blocks, each of which stores an absolute base and per-match
+//  deltas from that base, 16-bit ones unless the block spans more bytes than that. Lengths are stored in a byte, the
+//  rare ones that don't fit are kept aside. Frequent matches, the ones that add up, cost about 3 bytes each instead of
+//  16, and random access is still O(1).
+//
+// NOTE: Matches are stored in the order they were found, which Hyperscan mostly reports by increasing start.
+class MatchIndex {
+public:
+	struct Match {
+		size_t start;
+		size_t end;
+
+		bool operator<(const Match &other) const {
+			return start < other.start;
+		}
+
+		bool operator<(size_t pos) const {
+			return start < pos;
+		}
+	};
+
+	// NOTE: Elements are decoded on access, so this yields values rather than references
+	class const_iterator {
+		const MatchIndex *index_ {};
+		size_t i_ {};
+
+		struct Arrow {
+			Match match;
+			const Match *operator->() const { return &match; }
+		};
+
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = Match;
+		using difference_type = std::ptrdiff_t;
+		using pointer = Arrow;
+		using reference = Match;
+
+		const_iterator() = default;
+		const_iterator(const MatchIndex *index, size_t i) : index_(index), i_(i) {}
+
+		Match operator*() const { return index_->at(i_); }
+		Arrow operator->() const { return {index_->at(i_)}; }
+		Match operator[](difference_type n) const { return index_->at(i_ + n); }
+
+		const_iterator &operator++() { i_++; return *this; }
+		const_iterator operator++(int) { auto it = *this; i_++; return it; }
+		const_iterator &operator--() { i_--; return *this; }
+		const_iterator operator--(int) { auto it = *this; i_--; return it; }
+		const_iterator &operator+=(difference_type n) { i_ += n; return *this; }
+		const_iterator &operator-=(difference_type n) { i_ -= n; return *this; }
+		const_iterator operator+(difference_type n) const { return {index_, i_ + n}; }
+		const_iterator operator-(difference_type n) const { return {index_, i_ - n}; }
+		friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+		difference_type operator-(const const_iterator &other) const { return (difference_type)i_ - (difference_type)other.i_; }
+
+		bool operator==(const const_iterator &other) const { return i_ == other.i_; }
+		auto operator<=>(const const_iterator &other) const { return i_ <=> other.i_; }
+	};
+
+private:
+	static constexpr size_t BLOCK_SHIFT = 6;
+	static constexpr size_t BLOCK_SIZE = 1ULL << BLOCK_SHIFT;
+	static constexpr size_t BLOCK_MASK = BLOCK_SIZE - 1;
+	// Lengths from this up are kept in longs_
+	static constexpr uint8_t LONG_LENGTH = UINT8_MAX;
+
+	enum class Width : uint8_t {
+		k16,
+		k32,
+		k64,
+	};
+
+	struct Long {
+		size_t index;
+		size_t length;
+	};
+
+	// The start of each block's first match
+	segarray<size_t> bases_ {};
+	// Where each block's deltas are, the index of its slot in the pool for its width << 2 | the width. Blocks are
+	//  widened while they're being filled, so this is accessed atomically.
+	segarray<uint64_t> locations_ {};
+	// NOTE: None of these move as they grow, so appending never copies the index
+	segarray<uint16_t> deltas16_ {};
+	segarray<uint32_t> deltas32_ {};
+	segarray<uint64_t> deltas64_ {};
+	segarray<uint8_t> lengths_ {};
+	segarray<Long> longs_ {};
+	// NOTE: Published after everything it covers, like segarray's
+	std::atomic<size_t> size_ {};
+
+	// Only accessed by the writer
+	size_t count_ {};
+	size_t max_delta_ {};
+	Width next_width_ {Width::k16};
+
+	// diable copy
+	MatchIndex(const MatchIndex &) = delete;
+	MatchIndex &operator=(const MatchIndex &) = delete;
+
+	static Width width_for(size_t delta) {
+		return delta <= UINT16_MAX ? Width::k16 : delta <= UINT32_MAX ? Width::k32 : Width::k64;
+	}
+
+	uint64_t location(size_t block) const {
+		return std::atomic_ref(const_cast<uint64_t &>(locations_[block])).load(std::memory_order_acquire);
+	}
+
+	size_t delta(uint64_t location, size_t i) const {
+		const size_t pos = (location >> 2) * BLOCK_SIZE + i;
+		switch ((Width)(location & 3)) {
+			case Width::k16: return deltas16_[pos];
+			case Width::k32: return deltas32_[pos];
+			default:         return deltas64_[pos];
+		}
+	}
+
+	void set_delta(uint64_t location, size_t i, size_t delta) {
+		const size_t pos = (location >> 2) * BLOCK_SIZE + i;
+		switch ((Width)(location & 3)) {
+			case Width::k16: deltas16_[pos] = delta; break;
+			case Width::k32: deltas32_[pos] = delta; break;
+			default:         deltas64_[pos] = delta; break;
+		}
+	}
+
+	uint64_t allocate(Width width) {
+		auto allocate = [width](auto &pool) {
+			const size_t slot = pool.size() / BLOCK_SIZE;
+			pool.resize_uninitialized(pool.size() + BLOCK_SIZE);
+			return (uint64_t)slot << 2 | (uint64_t)width;
+		};
+		switch (width) {
+			case Width::k16: return allocate(deltas16_);
+			case Width::k32: return allocate(deltas32_);
+			default:         return allocate(deltas64_);
+		}
+	}
+
+	void open_block(size_t base) {
+		// NOTE: Blocks start out as wide as the previous one needed, so that they rarely have to be widened
+		bases_.push_back(base);
+		locations_.push_back(allocate(next_width_));
+		max_delta_ = 0;
+	}
+
+	void widen(size_t block, Width width) {
+		// NOTE: Readers may still be reading the old slot, so the block is copied to a new one rather than moved, and the
+		//  old one is left alone
+		const uint64_t from = location(block);
+		const uint64_t to = allocate(width);
+		for (size_t i = 0; i < (count_ & BLOCK_MASK); i++) {
+			set_delta(to, i, delta(from, i));
+		}
+		std::atomic_ref(locations_[block]).store(to, std::memory_order_release);
+	}
+
+	// Appends without publishing
+	void write(const Match &match) {
+		if ((count_ & BLOCK_MASK) == 0) {
+			open_block(match.start);
+		}
+		const size_t block = count_ >> BLOCK_SHIFT;
+		// NOTE: A match that starts before its block's base wraps around, into a 64-bit delta that wraps back on access
+		const size_t delta = match.start - bases_[block];
+		max_delta_ = std::max(max_delta_, delta);
+		if (width_for(delta) > (Width)(location(block) & 3)) {
+			widen(block, width_for(delta));
+		}
+		set_delta(location(block), count_ & BLOCK_MASK, delta);
+
+		const size_t length = match.end - match.start;
+		if (length >= LONG_LENGTH) {
+			longs_.push_back({count_, length});
+			lengths_.push_back(LONG_LENGTH);
+		} else {
+			lengths_.push_back((uint8_t)length);
+		}
+
+		count_++;
+		if ((count_ & BLOCK_MASK) == 0) {
+			next_width_ = width_for(max_delta_);
+		}
+	}
+
+	size_t length_of(size_t index) const {
+		const uint8_t length = lengths_[index];
+		if (length != LONG_LENGTH) {
+			return length;
+		}
+		auto it = std::lower_bound(longs_.begin(), longs_.end(), index,
+			[](const Long &l, size_t i) { return l.index < i; });
+		assert(it != longs_.end() && it->index == index);
+		return it->length;
+	}
+
+public:
+	MatchIndex() = default;
+
+	size_t size() const { return size_.load(std::memory_order_acquire); }
+	bool empty() const { return size() == 0; }
+	// Allocated bytes
+	size_t memory_usage() const {
+		return bases_.memory_usage() + locations_.memory_usage() + deltas16_.memory_usage() + deltas32_.memory_usage() +
+			deltas64_.memory_usage() + lengths_.memory_usage() + longs_.memory_usage();
+	}
+
+	Match operator[](size_t index) const { return at(index); }
+	Match at(size_t index) const {
+		assert(index < size());
+		const size_t block = index >> BLOCK_SHIFT;
+		const size_t start = bases_[block] + delta(location(block), index & BLOCK_MASK);
+		return {start, start + length_of(index)};
+	}
+
+	Match front() const { return at(0); }
+	Match back() const { return at(size() - 1); }
+
+	// NOTE: end() is the size at the time it's called, the array may have grown since
+	const_iterator begin() const { return {this, 0}; }
+	const_iterator end() const { return {this, size()}; }
+
+	void push_back(const Match &match) {
+		write(match);
+		size_.store(count_, std::memory_order_release);
+	}
+
+	void extend(const dynarray<Match> &matches) {
+		for (const auto &match : matches) {
+			write(match);
+		}
+		size_.store(count_, std::memory_order_release);
+	}
+};
@@ -0,0 +1,138 @@
+#include "newline_scanner.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static constexpr size_t BLOCK_SIZE = 64;
+
+// Records one line start per set bit of a 64-bit newline mask. Space for a whole block is reserved up front so that the
+//  loop is a plain store per newline, rather than a push_back with a capacity check.
+static inline __attribute__((always_inline))
+void emit(uint64_t mask, size_t block_start, dynarray<size_t> &out, NewlineScanner::State &state) {
+	if (!mask) {
+		return;
+	}
+	const size_t size = out.size();
+	out.reserve(size + BLOCK_SIZE);
+	size_t *dst = out.data() + size;
+
+	size_t prev_start = state.prev_start;
+	size_t longest_line = state.longest_line;
+	do {
+		const size_t line_start = block_start + std::countr_zero(mask) + 1;
+		*dst++ = line_start;
+		longest_line = std::max(longest_line, line_start - prev_start);
+		prev_start = line_start;
+		mask &= mask - 1;
+	} while (mask);
+
+	state.prev_start = prev_start;
+	state.longest_line = longest_line;
+	out.resize_uninitialized(dst - out.data());
+}
+
+void NewlineScanner::scan_scalar(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state) {
+	for (size_t offset = 0; offset < length; offset += BLOCK_SIZE) {
+		const size_t block_size = std::min(BLOCK_SIZE, length - offset);
+		uint64_t mask = 0;
+		for (size_t i = 0; i < block_size; i++) {
+			mask |= (uint64_t)(data[offset + i] == '\n') << i;
+		}
+		emit(mask, base + offset, out, state);
+	}
+}
+
+#if defined(__SSE2__)
+static inline uint64_t mask_sse2(const uint8_t *p) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p +  0)), nl));
+	uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), nl));
+	uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), nl));
+	uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), nl));
+	return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+void NewlineScanner::scan_sse2(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state) {
+	size_t offset = 0;
+	for (; offset + BLOCK_SIZE <= length; offset += BLOCK_SIZE) {
+		emit(mask_sse2(data + offset), base + offset, out, state);
+	}
+	if (offset < length) {
+		// Zero padding can't produce false matches
+		alignas(BLOCK_SIZE) uint8_t tail[BLOCK_SIZE] {};
+		std::memcpy(tail, data + offset, length - offset);
+		emit(mask_sse2(tail), base + offset, out, state);
+	}
+}
+#endif
+
+#if defined(USE_AVX2)
+__attribute__((target("avx2")))
+static inline uint64_t mask_avx2(const uint8_t *p) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p +  0)), nl));
+	uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), nl));
+	return lo | (hi << 32);
+}
+
+__attribute__((target("avx2")))
+void NewlineScanner::scan_avx2(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state) {
+	size_t offset = 0;
+	for (; offset + BLOCK_SIZE <= length; offset += BLOCK_SIZE) {
+		emit(mask_avx2(data + offset), base + offset, out, state);
+	}
+	if (offset < length) {
+		alignas(BLOCK_SIZE) uint8_t tail[BLOCK_SIZE] {};
+		std::memcpy(tail, data + offset, length - offset);
+		emit(mask_avx2(tail), base + offset, out, state);
+	}
+}
+#endif
+
+#if defined(USE_AVX512)
+__attribute__((target("avx512f,avx512bw")))
+static inline uint64_t mask_avx512(const uint8_t *p) {
+	return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p), _mm512_set1_epi8('\n'));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void NewlineScanner::scan_avx512(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state) {
+	size_t offset = 0;
+	for (; offset + BLOCK_SIZE <= length; offset += BLOCK_SIZE) {
+		emit(mask_avx512(data + offset), base + offset, out, state);
+	}
+	if (offset < length) {
+		// A masked load would avoid the copy, but this only runs once per chunk
+		alignas(BLOCK_SIZE) uint8_t tail[BLOCK_SIZE] {};
+		std::memcpy(tail, data + offset, length - offset);
+		emit(mask_avx512(tail), base + offset, out, state);
+	}
+}
+#endif
+
+std::span<const NewlineScanner::KernelInfo> NewlineScanner::kernels() {
+	static const auto kernels = std::to_array<KernelInfo>({
+		{"scalar", scan_scalar, true},
+#if defined(__SSE2__)
+		{"sse2", scan_sse2, true},
+#endif
+#if defined(USE_AVX2)
+		{"avx2", scan_avx2, (bool)__builtin_cpu_supports("avx2")},
+#endif
+#if defined(USE_AVX512)
+		{"avx512", scan_avx512, __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")},
+#endif
+	});
+	return kernels;
+}
+
+const NewlineScanner::KernelInfo &NewlineScanner::best() {
+	const auto all = kernels();
+	auto it = std::find_if(all.rbegin(), all.rend(), [](const KernelInfo &k) { return k.supported; });
+	return *it;
+}
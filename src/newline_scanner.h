@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <span>
+
+#include "dynarray.h"
+
+// Finds all newline characters in a buffer and records the offset just _after_ each one (i.e. the start of the next
+//  line). The widest kernel supported by the running CPU is selected once at runtime, so the binary doesn't need to be
+//  built for a specific instruction set.
+class NewlineScanner {
+public:
+	struct State {
+		// Absolute offset of the start of the line currently being scanned
+		size_t prev_start {};
+		// NOTE: This length includes the newline character
+		size_t longest_line {};
+	};
+
+	// Appends the absolute offset (base + relative offset) of every line start in [data, data + length) to out
+	using Kernel = void (*)(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state);
+
+	struct KernelInfo {
+		const char *name;
+		Kernel kernel;
+		bool supported;
+	};
+
+	static void scan_scalar(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state);
+#if defined(__SSE2__)
+	static void scan_sse2(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state);
+#endif
+#if defined(USE_AVX2)
+	static void scan_avx2(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state);
+#endif
+#if defined(USE_AVX512)
+	static void scan_avx512(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state);
+#endif
+
+	// All kernels compiled into this binary, from narrowest to widest
+	static std::span<const KernelInfo> kernels();
+	static const KernelInfo &best();
+
+	static void scan(const uint8_t *data, size_t length, size_t base, dynarray<size_t> &out, State &state) {
+		static const Kernel kernel = best().kernel;
+		kernel(data, length, base, out, state);
+	}
+};
@@ -0,0 +1,216 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "dynarray.h"
+#include "Tracy.hpp"
+
+// Append-only array with a single writer and any number of concurrent readers.
+//
+// Elements are stored in segments that double in size and never move, so growing the array doesn't copy it or
+//  invalidate references into it, and it never has to keep readers out while it grows. Indexing is still O(1): the
+//  segment is the position of the highest set bit of the index. The size is published after the elements it covers, so
+//  a reader may read any element below a size() it has loaded, without a lock.
+//
+// NOTE: The writer may also shrink the array (e.g. resize_uninitialized(0) to reuse it), but then it's up to the
+//  caller to make sure no reader is still looking at the elements past the new size.
+template<typename T, size_t FIRST_SHIFT = 10>
+class segarray {
+	static_assert(std::is_trivially_copyable_v<T>, "Elements are copied with memcpy");
+
+	static constexpr size_t FIRST_SIZE = 1ULL << FIRST_SHIFT;
+	static constexpr size_t MAX_SEGMENTS = 64 - FIRST_SHIFT;
+
+	template<typename U>
+	class basic_iterator {
+		using array_type = std::conditional_t<std::is_const_v<U>, const segarray, segarray>;
+
+		array_type *array_ {};
+		size_t index_ {};
+
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = std::remove_const_t<U>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = U *;
+		using reference = U &;
+
+		basic_iterator() = default;
+		basic_iterator(array_type *array, size_t index) : array_(array), index_(index) {}
+
+		reference operator*() const { return array_->at(index_); }
+		pointer operator->() const { return &array_->at(index_); }
+		reference operator[](difference_type n) const { return array_->at(index_ + n); }
+
+		basic_iterator &operator++() { index_++; return *this; }
+		basic_iterator operator++(int) { auto it = *this; index_++; return it; }
+		basic_iterator &operator--() { index_--; return *this; }
+		basic_iterator operator--(int) { auto it = *this; index_--; return it; }
+		basic_iterator &operator+=(difference_type n) { index_ += n; return *this; }
+		basic_iterator &operator-=(difference_type n) { index_ -= n; return *this; }
+		basic_iterator operator+(difference_type n) const { return {array_, index_ + n}; }
+		basic_iterator operator-(difference_type n) const { return {array_, index_ - n}; }
+		friend basic_iterator operator+(difference_type n, const basic_iterator &it) { return it + n; }
+		difference_type operator-(const basic_iterator &other) const { return (difference_type)index_ - (difference_type)other.index_; }
+
+		bool operator==(const basic_iterator &other) const { return index_ == other.index_; }
+		auto operator<=>(const basic_iterator &other) const { return index_ <=> other.index_; }
+	};
+
+	std::array<std::atomic<T *>, MAX_SEGMENTS> segments_ {};
+	std::atomic<size_t> size_ {};
+	// Only accessed by the writer
+	size_t num_segments_ {};
+
+	// diable copy
+	segarray(const segarray &) = delete;
+	segarray &operator=(const segarray &) = delete;
+
+	static size_t segment_of(size_t index) { return std::bit_width((index >> FIRST_SHIFT) + 1) - 1; }
+	static size_t segment_start(size_t segment) { return ((1ULL << segment) - 1) << FIRST_SHIFT; }
+	static size_t segment_size(size_t segment) { return FIRST_SIZE << segment; }
+
+	T *slot(size_t index) const {
+		const size_t segment = segment_of(index);
+		return segments_[segment].load(std::memory_order_acquire) + (index - segment_start(segment));
+	}
+
+	void release() {
+		for (size_t i = 0; i < num_segments_; i++) {
+			::operator delete(segments_[i].exchange(nullptr, std::memory_order_relaxed));
+		}
+		num_segments_ = 0;
+		size_.store(0, std::memory_order_relaxed);
+	}
+
+	// Writes count elements at the end without publishing them
+	void write(const T *values, size_t count) {
+		size_t index = size_.load(std::memory_order_relaxed);
+		reserve(index + count);
+		while (count) {
+			const size_t segment = segment_of(index);
+			const size_t n = std::min(count, segment_start(segment + 1) - index);
+			std::memcpy(slot(index), values, n * sizeof(T));
+			values += n;
+			index += n;
+			count -= n;
+		}
+	}
+
+public:
+	using iterator = basic_iterator<T>;
+	using const_iterator = basic_iterator<const T>;
+
+	segarray() = default;
+
+	// NOTE: Moving isn't thread safe, there must be no readers or writer at the time
+	segarray(segarray &&o) noexcept {
+		*this = std::move(o);
+	}
+	segarray &operator=(segarray &&o) noexcept {
+		if (this != &o) {
+			release();
+			for (size_t i = 0; i < MAX_SEGMENTS; i++) {
+				segments_[i].store(o.segments_[i].exchange(nullptr, std::memory_order_relaxed), std::memory_order_relaxed);
+			}
+			size_.store(o.size_.exchange(0, std::memory_order_relaxed), std::memory_order_release);
+			num_segments_ = std::exchange(o.num_segments_, 0);
+		}
+		return *this;
+	}
+
+	~segarray() {
+		release();
+	}
+
+	// Allocates segments up to at least n elements
+	void reserve(size_t n) {
+		while (segment_start(num_segments_) < n) {
+			ZoneScopedN("segarray alloc");
+			assert(num_segments_ < MAX_SEGMENTS);
+			T *segment = static_cast<T *>(::operator new(sizeof(T) * segment_size(num_segments_)));
+			segments_[num_segments_].store(segment, std::memory_order_release);
+			num_segments_++;
+		}
+	}
+
+	void resize_uninitialized(size_t n) {
+		reserve(n);
+		size_.store(n, std::memory_order_release);
+	}
+
+	size_t size() const { return size_.load(std::memory_order_acquire); }
+	bool empty() const { return size() == 0; }
+	// Allocated bytes
+	size_t memory_usage() const { return segment_start(num_segments_) * sizeof(T); }
+
+	T &operator[](size_t index) { return at(index); }
+	const T &operator[](size_t index) const { return at(index); }
+	T &at(size_t index) {
+		assert(index < size());
+		return *slot(index);
+	}
+	const T &at(size_t index) const {
+		assert(index < size());
+		return *slot(index);
+	}
+
+	T &front() { return at(0); }
+	const T &front() const { return at(0); }
+	T &back() { return at(size() - 1); }
+	const T &back() const { return at(size() - 1); }
+
+	// NOTE: end() is the size at the time it's called, the array may have grown since
+	iterator begin() { return {this, 0}; }
+	iterator end() { return {this, size()}; }
+	const_iterator begin() const { return {this, 0}; }
+	const_iterator end() const { return {this, size()}; }
+
+	// Index of the first element that isn't less than value, or size() if there is none
+	template<typename V, typename Compare = std::less<>>
+	size_t lower_bound(const V &value, Compare comp = {}) const {
+		return std::lower_bound(begin(), end(), value, comp) - begin();
+	}
+
+	// Calls f(data, count) for each contiguous run of elements, in order
+	template<typename F>
+	void for_each_segment(F &&f) const {
+		const size_t size = this->size();
+		for (size_t start = 0, segment = 0; start < size; segment++) {
+			const size_t count = std::min(size, segment_start(segment + 1)) - start;
+			f(static_cast<const T *>(slot(start)), count);
+			start += count;
+		}
+	}
+
+	void push_back(const T &value) {
+		const size_t size = size_.load(std::memory_order_relaxed);
+		reserve(size + 1);
+		*slot(size) = value;
+		size_.store(size + 1, std::memory_order_release);
+	}
+
+	template<typename... Args>
+	void emplace_back(Args&&... args) {
+		const size_t size = size_.load(std::memory_order_relaxed);
+		reserve(size + 1);
+		new (slot(size)) T(std::forward<Args>(args)...);
+		size_.store(size + 1, std::memory_order_release);
+	}
+
+	void extend(const T *values, size_t count) {
+		write(values, count);
+		size_.store(size_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+	}
+
+	void extend(const dynarray<T> &other) {
+		extend(other.data(), other.size());
+	}
+};
@@ -0,0 +1,25 @@
+#include "source.h"
+
+#include "compressed_source.h"
+#include "concat_source.h"
+#include "file_source.h"
+#include "stream_source.h"
+
+std::unique_ptr<Source> Source::create(const char *path) {
+	// NOTE: Checked first, as sniffing the format would consume the start of the stream
+	if (StreamSource::detect(path)) {
+		return std::make_unique<StreamSource>(path);
+	}
+	CompressedSource::Format format;
+	if (CompressedSource::detect(path, format)) {
+		return std::make_unique<CompressedSource>(path, format);
+	}
+	return std::make_unique<FileSource>(path, FileSource::default_backend(path));
+}
+
+std::unique_ptr<Source> Source::create(const std::vector<const char *> &paths) {
+	if (paths.size() == 1) {
+		return create(paths.front());
+	}
+	return std::make_unique<ConcatSource>(paths);
+}
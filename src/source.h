@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "file.h"
+
+// The bytes behind a Dataset: what the loader indexes, the Finder searches and the FileView renders.
+//
+// A source only ever grows. The loader thread is the only one that calls update(), while any thread may read() data
+//  below the length of a Dataset snapshot it holds, even while the source is being updated.
+class Source {
+public:
+	virtual ~Source() = default;
+
+	// Picks the right kind of source for path, based on its contents
+	static std::unique_ptr<Source> create(const char *path);
+	// Several paths are concatenated into one source
+	static std::unique_ptr<Source> create(const std::vector<const char *> &paths);
+
+	virtual int open() = 0;
+	virtual void close() = 0;
+	virtual const char *path() const = 0;
+	// Last modification time, in nanoseconds since an unspecified epoch
+	virtual int64_t mtime() const = 0;
+
+	// Data that can only be read once, front to back (e.g. stdin or a pipe). Streams have no file to watch for changes,
+	//  and call on_available instead whenever more data can be read.
+	virtual bool is_stream() const { return false; }
+	virtual void set_on_available(std::function<void()> &&on_available) {}
+	// Whether the line index can be persisted between runs, keyed by path()
+	virtual bool is_cacheable() const { return true; }
+
+	// Number of bytes the next update() could make readable. This is an upper bound for sources that only find out
+	//  their size as they go, e.g. compressed files.
+	virtual size_t available() const = 0;
+	// True if the file was rotated or truncated since the last update(). The data that's readable so far stays as is,
+	//  and the next update() continues with the new file after it.
+	virtual bool rotated() const { return false; }
+	// True if update() can make more data readable without the underlying file changing
+	virtual bool has_more() const { return false; }
+	// Whether update(length) keeps the data that's already readable in place. If not, the caller must publish a new
+	//  snapshot of the Dataset after the update.
+	virtual bool can_update_in_place(size_t length) const { return true; }
+	// Memory that earlier snapshots may still point into after an update that moved it (e.g. a mapping the file
+	//  outgrew) is passed to retire rather than freed, and retire frees it once no one reads it anymore. Without it,
+	//  that memory is freed right away.
+	virtual void set_retire(std::function<void(std::function<void()> &&)> &&retire) { retire_ = std::move(retire); }
+	// Makes (up to) the first length bytes readable. Returns 0 on success.
+	virtual int update(size_t length) = 0;
+	// Number of readable bytes
+	virtual size_t length() const = 0;
+
+	// All the data, if it's contiguous in memory, otherwise nullptr
+	virtual const uint8_t *data() const { return nullptr; }
+	// Returns a pointer to [offset, offset + length). This points into data() if possible, or into buffer otherwise,
+	//  which must be at least length bytes long.
+	virtual const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const = 0;
+
+	virtual void advise(File::Access access) {}
+
+protected:
+	std::function<void(std::function<void()> &&)> retire_ {};
+
+	void retire(std::function<void()> &&free) const {
+		if (retire_) {
+			retire_(std::move(free));
+		} else {
+			free();
+		}
+	}
+};
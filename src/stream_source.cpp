@@ -0,0 +1,242 @@
+#include "stream_source.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#ifndef WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "TracyC.h"
+#include "Tracy.hpp"
+
+StreamSource::~StreamSource() {
+	close();
+}
+
+bool StreamSource::detect(const char *path) {
+	if (strcmp(path, "-") == 0) {
+		return true;
+	}
+#ifdef WIN32
+	// NOTE: Named pipes can't be told apart without opening them
+	return strncmp(path, "\\\\.\\pipe\\", 9) == 0;
+#else
+	struct stat st {};
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+	return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode);
+#endif
+}
+
+int StreamSource::reserve() {
+	// Fall back to smaller reservations if the address space is limited (e.g. by ulimit -v)
+	for (size_t size = RESERVE_SIZE; size >= COMMIT_SIZE; size /= 4) {
+#ifdef WIN32
+		void *addr = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+		if (addr) {
+#else
+		void *addr = ::mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr != MAP_FAILED) {
+#endif
+			data_ = (uint8_t *)addr;
+			reserved_size_ = size;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int StreamSource::commit(size_t size) {
+	size = std::min(reserved_size_, (size + COMMIT_SIZE - 1) / COMMIT_SIZE * COMMIT_SIZE);
+	if (size <= committed_size_) {
+		return size == reserved_size_ ? -1 : 0;
+	}
+#ifdef WIN32
+	if (!VirtualAlloc(data_ + committed_size_, size - committed_size_, MEM_COMMIT, PAGE_READWRITE)) {
+		return -2;
+	}
+#else
+	if (mprotect(data_ + committed_size_, size - committed_size_, PROT_READ | PROT_WRITE) != 0) {
+		return -2;
+	}
+#endif
+	committed_size_ = size;
+	return 0;
+}
+
+int StreamSource::open() {
+#ifdef WIN32
+	if (path_ == "-") {
+		handle_ = GetStdHandle(STD_INPUT_HANDLE);
+	} else {
+		handle_ = CreateFileA(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	}
+	if (handle_ == INVALID_HANDLE_VALUE || handle_ == NULL) {
+		return -1;
+	}
+#else
+	fd_ = path_ == "-" ? STDIN_FILENO : ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ == -1) {
+		return -1;
+	}
+	if (pipe(wake_pipe_) != 0) {
+		return -2;
+	}
+#endif
+
+	if (reserve() != 0 || commit(COMMIT_SIZE) != 0) {
+		std::cerr << "Failed to reserve memory for " << path_ << "\n";
+		return -3;
+	}
+#ifdef WIN32
+	// NOTE: Set before the thread starts, so that a close() right away still waits for it to finish reading
+	reading_ = true;
+#endif
+	reader_ = std::thread(&StreamSource::reader, this);
+	return 0;
+}
+
+void StreamSource::close() {
+#ifdef WIN32
+	quit_ = true;
+	if (reader_.joinable()) {
+		// NOTE: The reader may be just about to start a read, so keep cancelling until it notices quit_
+		while (reading_) {
+			if (HANDLE thread = OpenThread(THREAD_TERMINATE, FALSE, reader_id_)) {
+				CancelSynchronousIo(thread);
+				CloseHandle(thread);
+			}
+			Sleep(1);
+		}
+		reader_.join();
+	}
+	if (handle_ != INVALID_HANDLE_VALUE && handle_ != GetStdHandle(STD_INPUT_HANDLE)) {
+		CloseHandle(handle_);
+	}
+	handle_ = INVALID_HANDLE_VALUE;
+	if (data_) {
+		VirtualFree(data_, 0, MEM_RELEASE);
+	}
+#else
+	if (wake_pipe_[1] != -1) {
+		::close(wake_pipe_[1]);
+		wake_pipe_[1] = -1;
+	}
+	if (reader_.joinable()) {
+		reader_.join();
+	}
+	if (wake_pipe_[0] != -1) {
+		::close(wake_pipe_[0]);
+		wake_pipe_[0] = -1;
+	}
+	if (fd_ != -1 && fd_ != STDIN_FILENO) {
+		::close(fd_);
+	}
+	fd_ = -1;
+	if (data_) {
+		::munmap(data_, reserved_size_);
+	}
+#endif
+	data_ = nullptr;
+	reserved_size_ = 0;
+	committed_size_ = 0;
+}
+
+void StreamSource::reader() {
+	TracyCSetThreadName("Stream reader");
+#ifdef WIN32
+	reader_id_ = GetCurrentThreadId();
+#endif
+	size_t received = received_;
+	bool done = false;
+	while (!done) {
+		// Read everything that's already buffered in the pipe before waking the loader, so that a fast writer is
+		//  indexed in large batches rather than a pipe buffer at a time
+		const size_t batch_start = received;
+		while (received - batch_start < READ_SIZE) {
+			if (received == committed_size_ && commit(received + COMMIT_SIZE) != 0) {
+				std::cerr << "Stopped reading " << path_ << " after " << received << " B, out of memory\n";
+				done = true;
+				break;
+			}
+			const size_t size = std::min(READ_SIZE, committed_size_ - received);
+#ifdef WIN32
+			if (quit_) {
+				done = true;
+				break;
+			}
+			DWORD num_read = 0;
+			if (!ReadFile(handle_, data_ + received, (DWORD)size, &num_read, NULL)) {
+				// NOTE: ERROR_BROKEN_PIPE is the end of a pipe, and ERROR_OPERATION_ABORTED comes from close()
+				if (const DWORD err = GetLastError(); err != ERROR_BROKEN_PIPE && err != ERROR_OPERATION_ABORTED) {
+					std::cerr << "Failed to read " << path_ << ": " << err << "\n";
+				}
+				done = true;
+				break;
+			}
+			const int64_t ret = num_read;
+			// NOTE: There's no cheap way to check whether more is buffered, so each read is a batch
+			const bool more = false;
+#else
+			pollfd fds[] {
+				{fd_, POLLIN, 0},
+				{wake_pipe_[0], POLLIN, 0},
+			};
+			// Only block if nothing has been read yet in this batch
+			const int ready = poll(fds, 2, received == batch_start ? -1 : 0);
+			if (ready < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ready <= 0 && received != batch_start) {
+				break;
+			}
+			if (ready < 0 || fds[1].revents) {
+				done = true;
+				break;
+			}
+			const ssize_t ret = ::read(fd_, data_ + received, size);
+			if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			if (ret < 0) {
+				std::cerr << "Failed to read " << path_ << ": " << strerror(errno) << "\n";
+			}
+			const bool more = true;
+#endif
+			if (ret <= 0) {
+				// End of stream
+				done = true;
+				break;
+			}
+			received += ret;
+			if (!more) {
+				break;
+			}
+		}
+
+		if (received != batch_start) {
+			ZoneScopedN("stream batch");
+			received_ = received;
+			if (on_available_) {
+				on_available_();
+			}
+		}
+	}
+	std::cout << "Finished reading " << path_ << ": " << received << " B\n";
+#ifdef WIN32
+	reading_ = false;
+#endif
+}
+
+int StreamSource::update(size_t length) {
+	// NOTE: The data is already in place, it just hasn't been published yet
+	length_ = std::min(length, received_.load());
+	return 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "source.h"
+
+// stdin, a pipe or a socket, e.g. `kubectl logs -f pod | log_viewer -`.
+//
+// A reader thread reads the stream straight into a large reserved region of memory, committing it as it fills up. The
+//  region never moves, so the stream is indexed and searched in place like a mapped file, without copying lines around.
+class StreamSource : public Source {
+	// NOTE: Only address space, memory is committed as the stream grows
+	static constexpr size_t RESERVE_SIZE = sizeof(void *) == 8 ? 64ULL * 1024 * 1024 * 1024 : 1ULL * 1024 * 1024 * 1024;
+	static constexpr size_t COMMIT_SIZE = 64ULL * 1024 * 1024;
+	// Upper bound per read. Pipes rarely return more than 64 KB at a time, but files redirected to stdin do.
+	static constexpr size_t READ_SIZE = 4ULL * 1024 * 1024;
+
+	const std::string path_;
+	uint8_t *data_ {};
+	size_t reserved_size_ {};
+	size_t committed_size_ {};
+	// Written by the reader thread only
+	std::atomic<size_t> received_ {};
+	size_t length_ {};
+	std::function<void()> on_available_ {};
+	std::thread reader_ {};
+#ifdef WIN32
+	HANDLE handle_ {INVALID_HANDLE_VALUE};
+	// NOTE: Blocking reads can only be cancelled from another thread by thread id, which std::thread doesn't expose
+	std::atomic<DWORD> reader_id_ {};
+	std::atomic<bool> reading_ {};
+	std::atomic<bool> quit_ {};
+#else
+	int fd_ = -1;
+	// The reader polls the read end. Closing the write end wakes it up on close().
+	int wake_pipe_[2] {-1, -1};
+#endif
+
+	int reserve();
+	int commit(size_t size);
+	void reader();
+
+	StreamSource() = delete;
+	StreamSource(const StreamSource &) = delete;
+	StreamSource &operator=(const StreamSource &) = delete;
+	StreamSource(StreamSource &&) = delete;
+	StreamSource &operator=(StreamSource &&) = delete;
+
+public:
+	// "-" is stdin
+	explicit StreamSource(const char *path) : path_(path) {}
+	~StreamSource() override;
+
+	// Returns true if path can only be read once, front to back
+	static bool detect(const char *path);
+
+	int open() override;
+	void close() override;
+	const char *path() const override { return path_.c_str(); }
+	int64_t mtime() const override { return 0; }
+
+	bool is_stream() const override { return true; }
+	bool is_cacheable() const override { return false; }
+	void set_on_available(std::function<void()> &&on_available) override { on_available_ = std::move(on_available); }
+
+	size_t available() const override { return received_; }
+	int update(size_t length) override;
+	size_t length() const override { return length_; }
+
+	const uint8_t *data() const override { return data_; }
+	const uint8_t *read(size_t offset, size_t length, uint8_t *buffer) const override { return data_ + offset; }
+};
@@ -36,7 +36,7 @@ StripeView::Dataset::Dataset(StripeView &parent,	color color)
 	reset();
 }
 
-void StripeView::Dataset::feed(const dynarray<size_t> &line_starts, const dynarray<size_t> &poi_lines) {
+void StripeView::Dataset::feed(const LineIndex &line_starts, const segarray<size_t> &poi_lines) {
 	const size_t num_lines = line_starts.size();
 	assert(num_lines >= prev_num_lines_);
 
@@ -2,7 +2,8 @@
 #include <functional>
 #include <memory>
 
-#include "dynarray.h"
+#include "segarray.h"
+#include "line_index.h"
 #include "stripe_shader.h"
 #include "widget.h"
 #include "types.h"
@@ -33,7 +34,7 @@ public:
 
 	public:
 		Dataset(StripeView &parent,	color color);
-		void feed(const dynarray<size_t> &line_starts, const dynarray<size_t> &poi_lines);
+		void feed(const LineIndex &line_starts, const segarray<size_t> &poi_lines);
 	};
 
 private:
@@ -57,7 +58,7 @@ public:
 
 	void add_dataset(void *key, color color);
 	void remove_dataset(void *key);
-	void feed(void *ctx, const dynarray<size_t> &line_starts, const dynarray<size_t> &poi_lines) {
+	void feed(void *ctx, const LineIndex &line_starts, const segarray<size_t> &poi_lines) {
 		if (datasets_.find(ctx) == datasets_.end()) {
 			assert(false);
 			return; // no dataset for this context
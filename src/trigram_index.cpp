@@ -0,0 +1,245 @@
+#include "trigram_index.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <hs/hs_compile.h>
+
+// NOTE: Only ASCII, like Hyperscan's HS_FLAG_CASELESS without HS_FLAG_UTF8
+static constexpr auto FOLD = [] {
+	std::array<uint8_t, 256> fold {};
+	for (size_t c = 0; c < fold.size(); c++) {
+		fold[c] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	}
+	return fold;
+}();
+
+// Fibonacci hashing of a folded trigram into the bits of a block
+static uint16_t mix(uint32_t trigram) {
+	return (uint16_t)((trigram * 0x9E3779B1u) >> 16);
+}
+
+// Index of the ']' that closes the character class starting at start, or npos
+static size_t skip_class(std::string_view pattern, size_t start) {
+	size_t i = start + 1;
+	if (i < pattern.size() && pattern[i] == '^') {
+		i++;
+	}
+	// A ']' right at the start is part of the class
+	if (i < pattern.size() && pattern[i] == ']') {
+		i++;
+	}
+	for (; i < pattern.size(); i++) {
+		if (pattern[i] == '\\') {
+			i++;
+		} else if (pattern.substr(i, 2) == "[:") {
+			// NOTE: POSIX classes like [:alpha:]
+			i = pattern.find(":]", i + 2);
+			if (i == std::string_view::npos) {
+				return i;
+			}
+			i++;
+		} else if (pattern[i] == ']') {
+			return i;
+		}
+	}
+	return std::string_view::npos;
+}
+
+// Runs of plain characters that every match of a regular expression contains. Only looks at the top level of patterns
+//  without alternations, and stops at anything it doesn't understand, so it may miss some but never makes one up.
+static std::vector<std::string> literals(std::string_view pattern) {
+	std::vector<std::string> literals;
+	if (pattern.find('|') != std::string_view::npos) {
+		return literals;
+	}
+	std::string run;
+	auto end_run = [&] {
+		if (run.size() >= 3) {
+			literals.push_back(run);
+		}
+		run.clear();
+	};
+	// The last character of the run, taking multibyte UTF-8 characters as a whole
+	auto last = [&] {
+		size_t start = run.size();
+		while (start > 0 && ((uint8_t)run[start - 1] & 0xC0) == 0x80) {
+			start--;
+		}
+		return start > 0 ? start - 1 : 0;
+	};
+
+	for (size_t i = 0; i < pattern.size(); i++) {
+		const char c = pattern[i];
+		switch (c) {
+			case '\\':
+				// Zero-width assertions just separate the runs around them, e.g. in whole-word searches
+				if (i + 1 < pattern.size() && std::string_view("bBAzZ").find(pattern[i + 1]) != std::string_view::npos) {
+					end_run();
+					i++;
+					break;
+				}
+				// NOTE: Other escaped letters and digits are classes (\d), or take more parsing (\x41, \Q..\E)
+				if (i + 1 == pattern.size() || isalnum((uint8_t)pattern[i + 1])) {
+					end_run();
+					return literals;
+				}
+				run += pattern[++i];
+				break;
+			case '*':
+			case '?':
+			case '{':
+				// The character before is optional
+				run.resize(last());
+				end_run();
+				if (c == '{') {
+					i = pattern.find('}', i);
+					if (i == std::string_view::npos) {
+						return literals;
+					}
+				}
+				break;
+			case '+': {
+				// The character before is required, but may be repeated
+				std::string repeated = run.substr(last());
+				end_run();
+				run = std::move(repeated);
+				break;
+			}
+			case '[':
+				end_run();
+				i = skip_class(pattern, i);
+				if (i == std::string_view::npos) {
+					return literals;
+				}
+				break;
+			case '(': {
+				// NOTE: Groups may be optional, so their contents don't count. Inline options are fine, as the index is
+				//  caseless anyway, except (?x), which makes the rest of the pattern ignore whitespace.
+				end_run();
+				if (pattern.substr(i, 2) == "(?") {
+					for (size_t j = i + 2; j < pattern.size() && (isalpha((uint8_t)pattern[j]) || pattern[j] == '-'); j++) {
+						if (pattern[j] == 'x') {
+							return {};
+						}
+					}
+				}
+				size_t depth = 0;
+				for (; i < pattern.size(); i++) {
+					if (pattern[i] == '\\') {
+						i++;
+					} else if (pattern[i] == '[') {
+						i = skip_class(pattern, i);
+						if (i == std::string_view::npos) {
+							return literals;
+						}
+					} else if (pattern[i] == '(') {
+						depth++;
+					} else if (pattern[i] == ')' && --depth == 0) {
+						break;
+					}
+				}
+				if (i >= pattern.size()) {
+					return literals;
+				}
+				break;
+			}
+			case ')':
+				end_run();
+				return literals;
+			case '.':
+			case '^':
+			case '$':
+				end_run();
+				break;
+			default:
+				run += c;
+				break;
+		}
+	}
+	end_run();
+	return literals;
+}
+
+void TrigramIndex::disable() {
+	enabled_ = false;
+}
+
+bool TrigramIndex::enabled() {
+	static const bool wanted = [] {
+		const char *value = getenv("LOG_VIEWER_TRIGRAMS");
+		return !value || !*value || *value != '0';
+	}();
+	return enabled_ && wanted;
+}
+
+uint16_t TrigramIndex::hash(uint8_t a, uint8_t b, uint8_t c) {
+	return mix((uint32_t)FOLD[a] << 16 | (uint32_t)FOLD[b] << 8 | FOLD[c]);
+}
+
+void TrigramIndex::add_trigrams(std::string_view literal, Trigrams &trigrams) {
+	for (size_t i = 0; i + 2 < literal.size(); i++) {
+		trigrams.push_back(hash(literal[i], literal[i + 1], literal[i + 2]));
+	}
+}
+
+TrigramIndex::Trigrams TrigramIndex::required(std::string_view pattern, bool regex, unsigned int flags) {
+	Trigrams trigrams;
+	// NOTE: Unicode caseless matching also folds non-ASCII letters (e.g. É and é), and a few ASCII ones to others (e.g.
+	//  K to the Kelvin sign), which the index doesn't
+	if ((flags & HS_FLAG_CASELESS) && (flags & (HS_FLAG_UTF8 | HS_FLAG_UCP))) {
+		return trigrams;
+	}
+	if (regex) {
+		for (const auto &literal : literals(pattern)) {
+			add_trigrams(literal, trigrams);
+		}
+	} else {
+		add_trigrams(pattern, trigrams);
+	}
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	return trigrams;
+}
+
+void TrigramIndex::add(const uint8_t *data) {
+	uint64_t bits[WORDS] {};
+	uint32_t trigram = (uint32_t)FOLD[data[0]] << 8 | FOLD[data[1]];
+	for (size_t i = 2; i < BLOCK_SIZE + OVERHANG; i++) {
+		trigram = (trigram << 8 | FOLD[data[i]]) & 0xFFFFFF;
+		const uint16_t h = mix(trigram);
+		bits[h >> 6] |= 1ULL << (h & 63);
+	}
+	bits_.extend(bits, WORDS);
+}
+
+bool TrigramIndex::write(FILE *f, size_t size) const {
+	assert(size <= this->size());
+	const uint64_t header = size;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (size_t block = 0; ok && block < size; block++) {
+		ok = fwrite(block_bits(block), sizeof(uint64_t), WORDS, f) == WORDS;
+	}
+	return ok;
+}
+
+bool TrigramIndex::read(const uint8_t *&data, const uint8_t *end) {
+	uint64_t size;
+	if ((size_t)(end - data) < sizeof(size)) {
+		return false;
+	}
+	std::memcpy(&size, data, sizeof(size));
+	data += sizeof(size);
+
+	if ((size_t)(end - data) / (WORDS * sizeof(uint64_t)) < size || !bits_.empty()) {
+		return false;
+	}
+	// NOTE: The data isn't necessarily aligned, extend() copies it bytewise
+	bits_.extend(reinterpret_cast<const uint64_t *>(data), size * WORDS);
+	data += size * WORDS * sizeof(uint64_t);
+	return true;
+}
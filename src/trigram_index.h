@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+#include "segarray.h"
+
+// Which trigrams each fixed size block of a dataset contains, so that a search for a selective pattern (e.g. a request
+//  ID) only has to scan the few blocks that can hold a match, rather than the whole file.
+//
+// Each block gets a bitmap of its hashed trigrams, i.e. a Bloom filter with a single hash function. A block can only
+//  contain a string if the bits of all of the string's trigrams are set, and the odd false positive just costs a scan
+//  of the block. Letters are folded to lower case, so the same index serves caseless searches. The bitmaps take 1/32
+//  of the size of the data.
+//
+// NOTE: Single writer, any number of concurrent readers, like segarray
+class TrigramIndex {
+	static inline std::atomic<bool> enabled_ {true};
+
+public:
+	static constexpr size_t BLOCK_SIZE = 256ULL * 1024;
+	// Bits per block
+	static constexpr size_t BITS = 64ULL * 1024;
+	// The trigrams of a block are the ones that start in it, so the last two run into the next block
+	static constexpr size_t OVERHANG = 2;
+	// Smaller datasets are fast enough to search from start to end
+	static constexpr size_t MIN_DATA_SIZE = 256ULL * 1024 * 1024;
+
+	// Hashes of the folded trigrams of a string, or of a pattern's literal parts
+	using Trigrams = std::vector<uint16_t>;
+
+private:
+	static constexpr size_t WORDS = BITS / 64;
+	// NOTE: Segments of the array hold a whole number of blocks, so each block's words are contiguous
+	static_assert(WORDS == 1024);
+
+	segarray<uint64_t> bits_ {};
+
+	// diable copy
+	TrigramIndex(const TrigramIndex &) = delete;
+	TrigramIndex &operator=(const TrigramIndex &) = delete;
+
+	const uint64_t *block_bits(size_t block) const {
+		return &bits_[block * WORDS];
+	}
+
+public:
+	TrigramIndex() = default;
+
+	// Keeps the loader from building or restoring the index, e.g. so that benchmarks always scan the whole file
+	static void disable();
+	// False after disable(), or if LOG_VIEWER_TRIGRAMS=0 is set, for users who'd rather not spend the memory and disk
+	static bool enabled();
+
+	static uint16_t hash(uint8_t a, uint8_t b, uint8_t c);
+	static void add_trigrams(std::string_view literal, Trigrams &trigrams);
+	// Trigrams that every match of the pattern, compiled with the Hyperscan flags, contains. Empty if there's no telling,
+	//  e.g. for a regular expression without any literal of at least three characters that every match has to contain.
+	static Trigrams required(std::string_view pattern, bool regex, unsigned int flags);
+
+	// Number of blocks indexed so far
+	size_t size() const { return bits_.size() / WORDS; }
+	// End of the indexed part of the dataset
+	size_t end() const { return size() * BLOCK_SIZE; }
+	size_t memory_usage() const { return bits_.memory_usage(); }
+
+	// Whether a match containing all of the trigrams can end in the block. Such a match may start in the previous one,
+	//  as long as it's no longer than BLOCK_SIZE.
+	bool may_match(size_t block, const Trigrams &trigrams) const {
+		const uint64_t *bits = block_bits(block);
+		const uint64_t *prev = block > 0 ? block_bits(block - 1) : nullptr;
+		for (uint16_t trigram : trigrams) {
+			const uint64_t mask = 1ULL << (trigram & 63);
+			if (!(bits[trigram >> 6] & mask) && !(prev && (prev[trigram >> 6] & mask))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Indexes the next block. data holds BLOCK_SIZE + OVERHANG bytes.
+	void add(const uint8_t *data);
+
+	// Raw (native endian and layout) serialization of the first size blocks, used to persist the index between runs
+	bool write(FILE *f, size_t size) const;
+	// Appends the serialized index to an empty one, and advances data past it on success
+	bool read(const uint8_t *&data, const uint8_t *end);
+};
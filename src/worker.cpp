@@ -1,5 +1,7 @@
 #include "worker.h"
 
+#include <algorithm>
+
 
 void Event::set() {
 	{
@@ -21,23 +23,12 @@ bool Event::wait(const std::chrono::milliseconds timeout) const {
 bool Event::is_set() const {
 	return triggered_;
 }
-//
-// WorkerPool::Worker::Worker(WorkerPool &pool) : thread_{&WorkerPool::worker, &pool}, mtx_(pool.mtx_), cv_(pool.cv_) {
-//
-// }
-//
-// void WorkerPool::Worker::join() {
-// 	if (thread_.joinable()) {
-// 		thread_.join();
-// 	}
-// }
-
-WorkerPool::WorkerPool(size_t num_workers)
-// : workers_ (num_workers, *this) // TODO get this to work
-{
+WorkerPool::WorkerPool(size_t num_workers) {
 	for (size_t i = 0; i < num_workers; ++i) {
-		// workers_.emplace_back(*this);
-		workers_.emplace_back(&WorkerPool::worker, this);
+		queues_.push_back(std::make_unique<Queue>());
+	}
+	for (size_t i = 0; i < num_workers; ++i) {
+		workers_.emplace_back(&WorkerPool::worker, this, i);
 	}
 }
 
@@ -45,11 +36,26 @@ WorkerPool::~WorkerPool() {
 	close();
 }
 
-void WorkerPool::push(job_t job) {
+WorkerPool &WorkerPool::shared() {
+	static WorkerPool pool {std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_WORKERS)};
+	return pool;
+}
+
+// Index of the pool's queue that belongs to the current thread, if it's one of the pool's workers
+static thread_local const WorkerPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+void WorkerPool::push(Priority priority, const char *name, const CancelToken &token, std::function<void()> &&task) {
+	// NOTE: Follow-up tasks stay on the worker that pushed them, where their data is likely still in cache
+	const size_t index = current_pool == this ? current_queue : next_queue_++ % queues_.size();
+	{
+		Queue &queue = *queues_[index];
+		std::lock_guard lock(queue.mtx_);
+		queue.tasks_[(size_t)priority].push_back({name, &token, std::move(task)});
+	}
 	{
 		std::lock_guard lock(mtx_);
-		++active_jobs_;
-		queue_.push(std::move(job));
+		++queued_;
 	}
 	cv_.notify_one();
 }
@@ -67,33 +73,44 @@ void WorkerPool::close() {
 	}
 }
 
-void WorkerPool::wait_free(size_t num_free) {
-	size_t num_active = workers_.size() - num_free;
-	std::unique_lock lock(mtx_);
-	cv_.wait(lock, [this, num_active] { return active_jobs_ <= num_active; });
+bool WorkerPool::pop(size_t index, Task &task) {
+	for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+		// Own queue first, then steal from the others
+		for (size_t i = 0; i < queues_.size(); i++) {
+			Queue &queue = *queues_[(index + i) % queues_.size()];
+			std::lock_guard lock(queue.mtx_);
+			auto &tasks = queue.tasks_[priority];
+			if (!tasks.empty()) {
+				task = std::move(tasks.front());
+				tasks.pop_front();
+				--queued_;
+				return true;
+			}
+		}
+	}
+	return false;
 }
 
-void WorkerPool::worker() {
-	job_t job;
+void WorkerPool::worker(size_t index) {
+	tracy::SetThreadNameWithHint("Worker", 3);
+	current_pool = this;
+	current_queue = index;
+
+	Task task {};
 	while (true) {
-		{
+		if (!pop(index, task)) {
 			std::unique_lock lock(mtx_);
-			cv_.wait(lock, [this] { return quit_ || !queue_.empty(); });
-
-			if (quit_ && queue_.empty()) {
-				return; // Exit if quit flag is set and queue is empty
+			cv_.wait(lock, [this] { return quit_ || queued_ > 0; });
+			if (quit_ && queued_ <= 0) {
+				return; // Exit if quit flag is set and nothing is queued
 			}
-
-			job = std::move(queue_.front());
-			queue_.pop();
+			continue;
 		}
 
-		job(mtx_, cv_, quit_);
-
 		{
-			std::lock_guard lock(mtx_);
-			--active_jobs_;
+			ZoneTransientN(zone, task.name, true);
+			task.run();
 		}
-		cv_.notify_all();
+		task = {};
 	}
 }
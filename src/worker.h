@@ -1,8 +1,13 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <thread>
+#include <vector>
 #include "Tracy.hpp"
 
 class Event {
@@ -21,39 +26,81 @@ public:
 	bool is_set() const;
 };
 
-class WorkerPool {
-	// friend class Worker;
-	// class Worker {
-	// 	std::mutex &mtx_;
-	// 	std::condition_variable &cv_;
-	// 	std::thread thread_;
-	//
-	// public:
-	// 	Worker() = delete;
-	// 	Worker(WorkerPool &pool);
-	// 	void join();
-	// };
+// Cooperative cancellation of pool tasks. Tasks check it between chunks of work and return early once it's set.
+class CancelToken {
+	std::atomic<bool> cancelled_ {};
 
 public:
-	using job_t = std::function<void(const LockableBase(std::mutex) &pool_mtx, const std::condition_variable_any &pool_cv, const bool &pool_quit)>;
-	TracyLockable(std::mutex, mtx_);
-	std::condition_variable_any cv_ {};
+	void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+	bool is_cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+};
+
+// Runs the CPU heavy background work (indexing, searching) of all views on one set of threads, sized to the machine,
+//  so that many views and searches share the cores instead of each bringing threads of their own.
+//
+// Every worker has a queue of its own, which tasks pushed from that worker go to, and steals from the others when it
+//  runs dry. Higher priority tasks anywhere go before lower priority ones, and tasks of the same priority run in the
+//  order they were pushed, so long running work should be split into tasks that requeue themselves to stay fair.
+class WorkerPool {
+public:
+	// Highest first
+	enum class Priority {
+		// Whatever is needed to show the visible part of a view, e.g. a preview of the lines around it
+		kVISIBLE,
+		kSEARCH,
+		// E.g. indexing the rest of a file
+		kBACKGROUND,
+	};
+
+	// Upper bound on the size of the shared pool. Each running task may hold a user slot of a Dataset, which has room
+	//  for this many plus a few for the main thread and the loader, see Dataset::MAX_USERS.
+	static constexpr size_t MAX_WORKERS = 64;
 
 private:
-	// std::vector<Worker> workers_;
-	std::vector<std::thread> workers_;
-	std::queue<job_t> queue_ {};
+	static constexpr size_t NUM_PRIORITIES = 3;
+
+	struct Task {
+		// Shown in the profiler
+		const char *name;
+		// NOTE: Owned by whoever pushed the task, who has to make sure it outlives the task
+		const CancelToken *token;
+		std::function<void()> run;
+	};
+
+	struct Queue {
+		TracyLockable(std::mutex, mtx_);
+		std::array<std::deque<Task>, NUM_PRIORITIES> tasks_ {};
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues_ {};
+	std::vector<std::thread> workers_ {};
+	// Pushed but not yet taken. May briefly drop below 0 when a task is taken before it's counted.
+	std::atomic<int64_t> queued_ {};
+	// Spreads tasks pushed from outside the pool across the queues
+	std::atomic<size_t> next_queue_ {};
+	// NOTE: Only guards sleeping and waking up workers, the queues have their own locks
+	TracyLockable(std::mutex, mtx_);
+	std::condition_variable_any cv_ {};
 	bool quit_ {};
-	// Event quit_ {mtx_, cv_};
-	std::atomic<size_t> active_jobs_ {};
 
-	void worker();
+	void worker(size_t index);
+	bool pop(size_t index, Task &task);
+
+	WorkerPool() = delete;
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool &operator=(const WorkerPool &) = delete;
+	WorkerPool(WorkerPool &&) = delete;
+	WorkerPool &operator=(WorkerPool &&) = delete;
 
 public:
-	WorkerPool(size_t num_workers);
+	explicit WorkerPool(size_t num_workers);
 	~WorkerPool();
-	void push(job_t job);
+
+	// The process wide pool, with a worker per core
+	static WorkerPool &shared();
+
+	size_t size() const { return workers_.size(); }
+	// Tasks still run if token is cancelled while they're queued, it's up to them to check it
+	void push(Priority priority, const char *name, const CancelToken &token, std::function<void()> &&task);
 	void close();
-	void wait_free(size_t num_jobs);
 };
-
@@ -0,0 +1,200 @@
+// Checks which literals TrigramIndex::required() finds in patterns, and that searching only the blocks the index allows
+//  finds the same matches as searching everything.
+// Usage: trigram_index_test
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <hs/hs_compile.h>
+
+#include "trigram_index.h"
+
+static TrigramIndex::Trigrams trigrams_of(const std::vector<std::string> &literals) {
+	TrigramIndex::Trigrams trigrams;
+	for (const auto &literal : literals) {
+		TrigramIndex::add_trigrams(literal, trigrams);
+	}
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	return trigrams;
+}
+
+struct RequiredCase {
+	const char *pattern;
+	bool regex;
+	unsigned int flags;
+	// Runs of at least three characters that every match contains, or none if the index can't be used
+	std::vector<std::string> literals;
+};
+
+static const RequiredCase REQUIRED_CASES[] = {
+	// Literals
+	{"error", false, 0, {"error"}},
+	{"a.b*c", false, 0, {"a.b*c"}},
+	{"ab", false, 0, {}},
+	{"Timeout", false, HS_FLAG_CASELESS, {"Timeout"}},
+	// Plain runs and wildcards
+	{"error", true, 0, {"error"}},
+	{"err.*timeout", true, 0, {"err", "timeout"}},
+	{"^GET /api/v1$", true, 0, {"GET /api/v1"}},
+	// Alternation
+	{"foo|barbaz", true, 0, {}},
+	// Repeats
+	{"abcd?ef", true, 0, {"abc"}},
+	{"abcd*ef", true, 0, {"abc"}},
+	{"ab+cd", true, 0, {"bcd"}},
+	{"abc+d", true, 0, {"abc", "cd"}},
+	{"abc{2,3}def", true, 0, {"def"}},
+	{"abc{2", true, 0, {}},
+	// Groups
+	{"(foo)?barbaz", true, 0, {"barbaz"}},
+	{"x(a(b)c)+yzw", true, 0, {"yzw"}},
+	{"ab(c", true, 0, {}},
+	{"abcd)", true, 0, {"abcd"}},
+	{"x(a[b", true, 0, {}},
+	{"abcd(e[]", true, 0, {"abcd"}},
+	// Classes
+	{"a[xyz]bcdef", true, 0, {"bcdef"}},
+	{"[]x]abcd", true, 0, {"abcd"}},
+	{"[[:alpha:]]xyzw", true, 0, {"xyzw"}},
+	{"abc[def", true, 0, {"abc"}},
+	// Inline options
+	{"(?i)request id", true, 0, {"request id"}},
+	{"(?x)a b c d", true, 0, {}},
+	// Escapes
+	{"abc\\.def", true, 0, {"abc.def"}},
+	{"abc\\d+xyz", true, 0, {"abc"}},
+	{"user=\\w+ path=/api", true, 0, {"user="}},
+	{"\\bwarning\\b", true, 0, {"warning"}},
+	{"\\Afoo\\Bbarx\\z", true, 0, {"foo", "barx"}},
+	{"abc\\", true, 0, {"abc"}},
+	// UTF-8 runs, where an optional character is the whole multibyte sequence
+	{"caf\xc3\xa9s", true, HS_FLAG_UTF8, {"caf\xc3\xa9s"}},
+	{"x\xc3\xa9?yzw", true, HS_FLAG_UTF8, {"yzw"}},
+	// Unicode caseless matching folds more than the index does
+	{"caf\xc3\xa9", true, HS_FLAG_UTF8 | HS_FLAG_CASELESS, {}},
+	{"error", false, HS_FLAG_UCP | HS_FLAG_CASELESS, {}},
+};
+
+static int test_required() {
+	int failures = 0;
+	for (const auto &c : REQUIRED_CASES) {
+		if (TrigramIndex::required(c.pattern, c.regex, c.flags) != trigrams_of(c.literals)) {
+			fprintf(stderr, "FAIL: required(\"%s\", %s, 0x%x)\n", c.pattern, c.regex ? "regex" : "literal", c.flags);
+			failures++;
+		}
+	}
+	return failures;
+}
+
+// Log lines over a small vocabulary, with needles placed inside blocks and across block boundaries
+static std::string make_data(size_t blocks) {
+	static const char *WORDS[] = {"GET", "POST", "/api/v1/users", "/api/v1/orders", "200", "404", "500", "ms", "status"};
+	std::mt19937 rng {42};
+	std::string data;
+	data.reserve(blocks * TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG);
+	while (data.size() < blocks * TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG) {
+		for (int i = 0; i < 6; i++) {
+			data += WORDS[rng() % std::size(WORDS)];
+			data += ' ';
+		}
+		data += "req=" + std::to_string(rng() % 100000) + "\n";
+	}
+	data.resize(blocks * TrigramIndex::BLOCK_SIZE + TrigramIndex::OVERHANG);
+
+	auto place = [&](size_t pos, const std::string &needle) {
+		data.replace(pos, needle.size(), needle);
+	};
+	place(TrigramIndex::BLOCK_SIZE / 2, "Zebra-Quux");
+	place(3 * TrigramIndex::BLOCK_SIZE - 4, "Zebra-Quux");
+	place(5 * TrigramIndex::BLOCK_SIZE + 1000, "zebra-quux");
+	place(7 * TrigramIndex::BLOCK_SIZE - 1, "Kiwi#Mango");
+	return data;
+}
+
+static std::vector<size_t> find_all(const std::string &data, size_t start, size_t end, const std::string &needle, bool caseless) {
+	auto fold = [caseless](char c) {
+		return caseless && c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+	};
+	std::vector<size_t> ends;
+	for (size_t pos = start; pos + needle.size() <= end; pos++) {
+		if (std::equal(needle.begin(), needle.end(), data.begin() + pos, [&](char a, char b) { return fold(a) == fold(b); })) {
+			ends.push_back(pos + needle.size());
+		}
+	}
+	return ends;
+}
+
+static int test_search() {
+	static constexpr size_t BLOCKS = 8;
+	const std::string data = make_data(BLOCKS);
+	TrigramIndex index;
+	for (size_t block = 0; block < BLOCKS; block++) {
+		index.add((const uint8_t*)data.data() + block * TrigramIndex::BLOCK_SIZE);
+	}
+
+	struct SearchCase {
+		const char *needle;
+		bool caseless;
+		// Number of matches, or ANY for common strings
+		size_t expected;
+	};
+	static constexpr size_t ANY = SIZE_MAX;
+	const SearchCase cases[] = {
+		{"Zebra-Quux", false, 2},
+		{"zebra-quux", true, 3},
+		{"Kiwi#Mango", false, 1},
+		{"Lemon&Lime", false, 0},
+		{"/api/v1/orders 404", false, ANY},
+	};
+
+	int failures = 0;
+	for (const auto &c : cases) {
+		const auto trigrams = TrigramIndex::required(c.needle, false, c.caseless ? HS_FLAG_CASELESS : 0);
+		const size_t end = index.end();
+		const auto all = find_all(data, 0, end, c.needle, c.caseless);
+
+		// Matches that end in a candidate block, like Finder::search_index() looks for them
+		std::vector<size_t> indexed;
+		size_t candidates = 0;
+		for (size_t block = 0; block < index.size(); block++) {
+			if (!index.may_match(block, trigrams)) {
+				continue;
+			}
+			candidates++;
+			const size_t block_start = block * TrigramIndex::BLOCK_SIZE;
+			const size_t block_end = std::min(end, block_start + TrigramIndex::BLOCK_SIZE);
+			const size_t search_start = block_start - std::min(block_start, strlen(c.needle) - 1);
+			for (size_t match_end : find_all(data, search_start, block_end, c.needle, c.caseless)) {
+				if (match_end > block_start) {
+					indexed.push_back(match_end);
+				}
+			}
+		}
+
+		if (indexed != all || (c.expected != ANY && all.size() != c.expected)) {
+			fprintf(stderr, "FAIL: \"%s\": %zu matches with the index, %zu without, expected %zu\n", c.needle,
+				indexed.size(), all.size(), c.expected);
+			failures++;
+		}
+		if (all.size() <= 1 && candidates == index.size()) {
+			fprintf(stderr, "FAIL: \"%s\": the index didn't skip any of the %zu blocks\n", c.needle, index.size());
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main() {
+	const int failures = test_required() + test_search();
+	if (failures > 0) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}